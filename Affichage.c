@@ -12,11 +12,14 @@ char* chaine_type[] = {
     "SEQUENCE_OU",   // Séquence conditionnelle (||)
     "BG",            // Tache en arriere plan
     "PIPE",          // Pipe
+    "CHRONO",        // Mesure du temps (time)
     "REDIRECTION_I", // Redirection entree
     "REDIRECTION_O", // Redirection sortie standard
     "REDIRECTION_A", // Redirection sortie standard, mode append
     "REDIRECTION_E", // Redirection sortie erreur
-    "REDIRECTION_EO"};
+    "REDIRECTION_EO", // Redirection sorties erreur et standard
+    "REDIRECTION_HS", // Chaîne en entrée
+    "REDIRECTION_HD"};
 
 void
 indenter_vide (int indentation, int trait)
@@ -70,11 +73,14 @@ afficher_exprL (Expression* e, int indentation, int trait)
         case REDIRECTION_A:
         case REDIRECTION_E:
         case REDIRECTION_EO:
+        case REDIRECTION_HS:
+        case REDIRECTION_HD:
             indenter (indentation, trait);
             printf ("%s fichier [%s]\n", chaine_type[e->type], e->arguments[0]);
             afficher_exprL (e->gauche, indentation + trait, trait);
             break;
         case BG:
+        case CHRONO:
             indenter (indentation, trait);
             printf ("%s\n", chaine_type[e->type]);
             afficher_exprL (e->gauche, indentation + trait, trait);
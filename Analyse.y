@@ -1,20 +1,31 @@
 %{
 #include "Shell.h"
-extern int yylex(void);
 %}
 
+/* Analyseur reentrant : l'etat de flex est passe en parametre, l'arbre est
+   rendu dans analyse, aucune variable globale n'est touchee */
+%define api.pure full
+%param {void *analyseur}
+%parse-param {Analyse *analyse}
+
 %union {
   Expression *Expr;
   char       **ListeArgs;
-  char	     identificateur[TAILLE_ID];
+  Mot        mot;
+}
+
+%code {
+extern int yylex(YYSTYPE *, void *);
+static void yyerror(void *, Analyse *, const char *);
 }
 
-%token <identificateur> IDENTIFICATEUR
+%token <mot> IDENTIFICATEUR
 %nonassoc '&'
 %left ';' ET OU
+%right TEMPS
 %left '|'
-%token IN OUT OUT_APPEND ERR ERR_OUT
-%left  IN OUT OUT_APPEND ERR ERR_OUT
+%token IN OUT OUT_APPEND ERR ERR_OUT HERESTRING HEREDOC
+%left  IN OUT OUT_APPEND ERR ERR_OUT HERESTRING HEREDOC
 
 %type <Expr> expression_ou_rien
 %type <Expr> expression
@@ -24,7 +35,7 @@ extern int yylex(void);
 %%
 lignecommande	: expression_ou_rien '\n' 
 		    {
-  		      ExpressionAnalysee = $1;
+  		      analyse->resultat = $1;
   		      YYACCEPT;
 		    }
 		| error '\n'
@@ -82,6 +93,26 @@ expression	:
 		    {
   		      $$ = ConstruireNoeud (REDIRECTION_A, $1, NULL, $3);
 		    }
+	       	| expression HERESTRING IDENTIFICATEUR
+		    {
+		      /* Variables developpees, mais pas les motifs */
+		      char **p = InitialiserListeArguments ();
+		      $3.motif = 0;
+		      $$ = ConstruireNoeud (REDIRECTION_HS, $1, NULL,
+					    AjouterMot (p, $3));
+		    }
+	       	| expression HEREDOC IDENTIFICATEUR
+		    {
+		      /* Le texte est lu apres la ligne, jusqu'au delimiteur */
+		      char **p = InitialiserListeArguments ();
+		      $$ = ConstruireNoeud (REDIRECTION_HD, $1, NULL,
+					    AjouterArg (p, $3.debut, $3.longueur));
+		      AttendreDocument ($$, $3);
+		    }
+		| TEMPS expression
+		    {
+  		      $$ = ConstruireNoeud (CHRONO, $2, NULL, NULL);
+		    }
 		| expression '&'
 		    {
   		      $$ = ConstruireNoeud (BG, $1, NULL, NULL);
@@ -95,19 +126,28 @@ expression	:
 fichier		: IDENTIFICATEUR
 		    {
   		      char **p = InitialiserListeArguments ();
-  		      $$ = AjouterArg (p, yylval.identificateur);
+  		      $$ = AjouterArg (p, $1.debut, $1.longueur);
 		    }
 		;
 
 commande	: IDENTIFICATEUR
 		    {
   		      char **p = InitialiserListeArguments ();
-  		      $$ = AjouterArg (p, yylval.identificateur);
+  		      $$ = AjouterMot (p, $1);
 		    }
 		| commande IDENTIFICATEUR
 		    {
-		      $$ = AjouterArg ($1,yylval.identificateur);
+		      $$ = AjouterMot ($1, $2);
 		    }
 		;
 %%
 
+/* Erreur de syntaxe, tue pendant une analyse d'avance : la ligne est
+   analysee de nouveau a son tour, l'erreur est signalee a ce moment */
+static void
+yyerror(void *analyseur, Analyse *analyse, const char *s)
+{
+  (void) analyseur;
+  if (!analyse->silencieux)
+    fprintf(stderr, "%s\n", s);
+}
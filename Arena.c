@@ -0,0 +1,110 @@
+/*
+    Arena allocator
+    ===============
+
+    Memory is given by bumping a pointer in big chunks. Nothing is freed one
+    by one, arena_reset rewinds every chunk at once and keeps them, so the
+    next use of the arena does not need malloc anymore.
+*/
+
+#include "Arena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Size of the first chunk, next ones are bigger */
+#define ARENA_MINSZ 4096
+/* Every allocation is aligned on this, data starts aligned on it too */
+#define ARENA_ALIGN 16
+
+/* Create a chunk big enough for size bytes, twice as big as the previous one */
+static arena_chunk_t*
+new_chunk (const arena_chunk_t* prev, size_t size)
+{
+    arena_chunk_t* chunk;
+    size_t chunksz = prev ? prev->size * 2 : ARENA_MINSZ;
+
+    if (chunksz < size)
+        chunksz = size;
+
+    if ((chunk = malloc (sizeof *chunk + chunksz)) == NULL)
+    {
+        perror ("malloc");
+        exit (EXIT_FAILURE);
+    }
+
+    chunk->next = NULL;
+    chunk->size = chunksz;
+    chunk->used = 0;
+    return chunk;
+}
+
+/* Allocate memory */
+void*
+arena_alloc (Arena* a, size_t size)
+{
+    arena_chunk_t* chunk = a->cur;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+    /* Use the next kept chunks if the current one is full */
+    while (chunk && chunk->used + size > chunk->size)
+    {
+        if (!chunk->next)
+            chunk->next = new_chunk (chunk, size);
+        chunk = chunk->next;
+    }
+
+    /* First allocation */
+    if (!chunk)
+        chunk = a->first = new_chunk (NULL, size);
+
+    a->cur = chunk;
+
+    void* p = (char*) chunk->data + chunk->used;
+    chunk->used += size;
+    return p;
+}
+
+/* Allocate zeroed memory */
+void*
+arena_calloc (Arena* a, size_t n, size_t size)
+{
+    void* p = arena_alloc (a, n * size);
+    memset (p, 0, n * size);
+    return p;
+}
+
+/* Copy a string */
+char*
+arena_strndup (Arena* a, const char* s, size_t n)
+{
+    char* p = arena_alloc (a, n + 1);
+    memcpy (p, s, n);
+    p[n] = '\0';
+    return p;
+}
+
+/* Rewind all chunks */
+void
+arena_reset (Arena* a)
+{
+    for (arena_chunk_t* chunk = a->first; chunk; chunk = chunk->next)
+        chunk->used = 0;
+    a->cur = a->first;
+}
+
+/* Free all chunks */
+void
+arena_release (Arena* a)
+{
+    arena_chunk_t* next;
+    for (arena_chunk_t* chunk = a->first; chunk; chunk = next)
+    {
+        next = chunk->next;
+        free (chunk);
+    }
+    a->first = NULL;
+    a->cur   = NULL;
+}
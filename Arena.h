@@ -0,0 +1,42 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+/* Bump allocator, everything is freed at once by arena_reset */
+/* Chunks are kept on reset so a steady workload stops calling malloc */
+
+/* Strictest alignment of the basic types, data is aligned on it */
+typedef union arena_align
+{
+    long double ld;
+    long long ll;
+    void* p;
+} arena_align_t;
+
+typedef struct arena_chunk
+{
+    struct arena_chunk* next; /* Next chunk */
+    size_t size;              /* Usable bytes in data */
+    size_t used;              /* Bytes already given */
+    arena_align_t data[];     /* Memory given by arena_alloc */
+} arena_chunk_t;
+
+typedef struct Arena
+{
+    arena_chunk_t* first; /* First chunk */
+    arena_chunk_t* cur;   /* Chunk currently used */
+} Arena;
+
+/* Allocate memory from an arena, exits if no memory is available */
+extern void* arena_alloc (Arena* a, size_t size);
+/* Allocate zeroed memory from an arena */
+extern void* arena_calloc (Arena* a, size_t n, size_t size);
+/* Copy n characters of a string into an arena, adds the final '\0' */
+extern char* arena_strndup (Arena* a, const char* s, size_t n);
+/* Free everything allocated, keeps the chunks for later */
+extern void arena_reset (Arena* a);
+/* Give back all chunks to the system */
+extern void arena_release (Arena* a);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef _BUILTINS_H
+#define _BUILTINS_H
+
+#include <stdint.h>
+
+/* Internal commands, listed in Builtins.def */
+/* mkbuiltins finds a seed making builtin_hash collision free over them and
+ * writes the table in BuiltinsTable.h */
+
+/* Flags of an internal command */
+#define BUILTIN_PIPE 0x1 /* Only prints, may run in a pipeline stage */
+
+typedef struct builtin
+{
+    const char* name;             /* Name of the command */
+    int (*handler) (char** argv); /* Returns the exit status */
+    int flags;                    /* BUILTIN_* */
+    const char* help;             /* Usage shown by "help" */
+} builtin_t;
+
+/* FNV-1a, seeded */
+static inline uint32_t
+builtin_hash (const char* str, uint32_t seed)
+{
+    uint32_t h = 2166136261u ^ seed;
+    while (*str)
+    {
+        h ^= (unsigned char) *str++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+#endif
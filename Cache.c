@@ -0,0 +1,200 @@
+/*
+    Parsed line cache
+    =================
+
+    The same lines come back again and again, from the history or from
+    generated scripts. Each tree is copied with its line in one block, looked
+    up by the exact text of the line, and the least recently used one is
+    dropped once CACHE_SIZE lines are kept.
+
+    The evaluator may attach its own data to a tree, such as the plan it
+    compiled from it, so that a line seen again is not compiled again. It
+    only has the tree, so entries are also indexed by the address of their
+    tree: a tree that did not come from the cache is simply not found.
+*/
+
+#include "Cache.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Number of lines kept */
+#define CACHE_SIZE 64
+/* Number of buckets, must be a power of two */
+#define CACHE_BUCKETS 128
+
+typedef struct cache_entry
+{
+    struct cache_entry* chain; /* Next entry of the bucket */
+    struct cache_entry* trees; /* Next entry of the bucket of its tree */
+    struct cache_entry* prev;  /* More recently used */
+    struct cache_entry* next;  /* Less recently used */
+    uint32_t hash;             /* Hash of the line */
+    size_t len;                /* Length of the line */
+    Expression* tree;          /* Copy of the tree, in the same block */
+    void* data;                /* Attached to the tree, freed with it */
+    char line[];               /* Text of the line, not terminated */
+} cache_entry_t;
+
+/* Hash table, chained */
+static cache_entry_t* buckets[CACHE_BUCKETS];
+/* Same entries by address of their tree */
+static cache_entry_t* tree_buckets[CACHE_BUCKETS];
+/* Most and least recently used entries */
+static cache_entry_t *mru = NULL, *lru = NULL;
+/* Number of entries */
+static int cache_used = 0;
+
+/* FNV-1a */
+static uint32_t
+hash_line (const char* line, size_t len)
+{
+    uint32_t h = 2166136261u;
+    while (len--)
+    {
+        h ^= (unsigned char) *line++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Bucket of a tree in tree_buckets */
+static size_t
+tree_bucket (const Expression* tree)
+{
+    uintptr_t h = (uintptr_t) tree;
+    return (h ^ h >> 7 ^ h >> 14) & (CACHE_BUCKETS - 1);
+}
+
+/* Remove an entry from the recently used list */
+static void
+unlink_entry (cache_entry_t* entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        mru = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        lru = entry->prev;
+}
+
+/* Put an entry first in the recently used list */
+static void
+push_entry (cache_entry_t* entry)
+{
+    entry->prev = NULL;
+    entry->next = mru;
+    if (mru)
+        mru->prev = entry;
+    mru = entry;
+    if (!lru)
+        lru = entry;
+}
+
+/* Drop the least recently used entry */
+static void
+evict (void)
+{
+    cache_entry_t* entry = lru;
+    cache_entry_t** it   = &buckets[entry->hash & (CACHE_BUCKETS - 1)];
+
+    while (*it != entry)
+        it = &(*it)->chain;
+    *it = entry->chain;
+
+    for (it = &tree_buckets[tree_bucket (entry->tree)]; *it != entry;
+         it = &(*it)->trees)
+        ;
+    *it = entry->trees;
+
+    unlink_entry (entry);
+    free (entry->data);
+    free (entry);
+    --cache_used;
+}
+
+/* Find the tree of a line */
+const Expression*
+cache_lookup (const char* line, size_t len)
+{
+    uint32_t h = hash_line (line, len);
+    cache_entry_t* entry;
+
+    for (entry = buckets[h & (CACHE_BUCKETS - 1)]; entry; entry = entry->chain)
+        if (entry->hash == h && entry->len == len
+            && memcmp (entry->line, line, len) == 0)
+        {
+            unlink_entry (entry);
+            push_entry (entry);
+            return entry->tree;
+        }
+
+    return NULL;
+}
+
+/* Keep a copy of the tree of a line */
+const Expression*
+cache_insert (const char* line, size_t len, const Expression* e)
+{
+    /* The tree goes after the line, aligned as a pointer */
+    size_t offset = (sizeof (cache_entry_t) + len + sizeof (void*) - 1)
+                    & ~(sizeof (void*) - 1);
+    cache_entry_t* entry = malloc (offset + TailleExpression (e));
+
+    if (entry == NULL)
+        return NULL;
+
+    if (cache_used == CACHE_SIZE)
+        evict ();
+
+    entry->hash = hash_line (line, len);
+    entry->len  = len;
+    entry->tree = CopierExpression (e, (char*) entry + offset);
+    entry->data = NULL;
+    memcpy (entry->line, line, len);
+
+    entry->chain = buckets[entry->hash & (CACHE_BUCKETS - 1)];
+    buckets[entry->hash & (CACHE_BUCKETS - 1)] = entry;
+    entry->trees = tree_buckets[tree_bucket (entry->tree)];
+    tree_buckets[tree_bucket (entry->tree)] = entry;
+    push_entry (entry);
+    ++cache_used;
+
+    return entry->tree;
+}
+
+/* Entry of a tree, NULL if it is not cached */
+static cache_entry_t*
+find_tree (const Expression* tree)
+{
+    cache_entry_t* entry;
+
+    for (entry = tree_buckets[tree_bucket (tree)]; entry; entry = entry->trees)
+        if (entry->tree == tree)
+            return entry;
+    return NULL;
+}
+
+/* Data attached to a cached tree */
+void*
+cache_data (const Expression* tree)
+{
+    cache_entry_t* entry = find_tree (tree);
+    return entry ? entry->data : NULL;
+}
+
+/* Attach data to a cached tree */
+int
+cache_attach (const Expression* tree, void* data)
+{
+    cache_entry_t* entry = find_tree (tree);
+
+    if (!entry)
+        return -1;
+    free (entry->data);
+    entry->data = data;
+    return 0;
+}
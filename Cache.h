@@ -0,0 +1,20 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include "Shell.h"
+
+/* Parsed trees of the last lines, a line seen again is not parsed again */
+/* Cached trees are shared between runs and must never be modified */
+
+/* Tree of a line, NULL if not cached */
+extern const Expression* cache_lookup (const char* line, size_t len);
+/* Copy the tree of a line into the cache, returns the copy or NULL */
+extern const Expression* cache_insert (const char* line,
+                                       size_t len,
+                                       const Expression* e);
+/* Data attached to a cached tree, NULL if none or if it is not cached */
+extern void* cache_data (const Expression* tree);
+/* Attach malloc'd data to a cached tree, freed with it, -1 if not cached */
+extern int cache_attach (const Expression* tree, void* data);
+
+#endif
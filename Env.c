@@ -0,0 +1,325 @@
+/*
+    Shell variables
+    ===============
+
+    Variables are kept in an open addressing table keyed by name. Each one
+    holds its "NAME=value" string, so the environment of commands is only
+    an array of pointers to the strings of exported variables.
+
+    That array is built when a command needs it, then shared by every
+    command until an exported variable changes. It is never modified in
+    place: a change only marks it stale and keeps the replaced strings
+    alive, the next command gets a new array and the old one is freed with
+    them. environ always points to the current array, so getenv and exec
+    see the same variables as the shell.
+*/
+
+#include "Env.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Initial number of slots, must be a power of two */
+#define ENV_MINSZ 64
+
+extern char** environ;
+
+typedef struct var
+{
+    char* pair;     /* "NAME=value", NULL if free slot */
+    size_t namelen; /* Length of NAME */
+    int exported;   /* Non zero if in the environment */
+} var_t;
+
+/* Open addressing table */
+static var_t* table = NULL;
+/* Number of slots in table */
+static size_t table_size = 0;
+/* Number of used slots in table */
+static size_t table_used = 0;
+/* Number of exported variables */
+static size_t exported = 0;
+
+/* Environment built from the table, environ points to it */
+static char** envp = NULL;
+/* Non zero if envp must be built again */
+static int stale = 1;
+/* Strings replaced since envp was built, still pointed by it */
+static char** retired      = NULL;
+static size_t retired_n    = 0;
+static size_t retired_size = 0;
+
+/* FNV-1a over len characters */
+static uint32_t
+hash_name (const char* name, size_t len)
+{
+    uint32_t h = 2166136261u;
+    while (len--)
+    {
+        h ^= (unsigned char) *name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Find the slot of a name, either its own or the free one it should use */
+static var_t*
+find_slot (const char* name, size_t len)
+{
+    size_t mask = table_size - 1;
+    size_t i    = hash_name (name, len) & mask;
+
+    while (table[i].pair
+           && (table[i].namelen != len
+               || memcmp (table[i].pair, name, len) != 0))
+        i = (i + 1) & mask;
+
+    return &table[i];
+}
+
+/* Double the size of the table, keeps load factor under 1/2 */
+static int
+grow_table (void)
+{
+    var_t* old      = table;
+    size_t old_size = table_size;
+
+    table_size = old_size ? old_size * 2 : ENV_MINSZ;
+    if ((table = calloc (table_size, sizeof *table)) == NULL)
+    {
+        table      = old;
+        table_size = old_size;
+        return -1;
+    }
+
+    for (size_t i = 0; i < old_size; ++i)
+        if (old[i].pair)
+            *find_slot (old[i].pair, old[i].namelen) = old[i];
+
+    free (old);
+    return 0;
+}
+
+/* The environment changes, a string of it is kept until it is rebuilt */
+static void
+retire (char* pair)
+{
+    stale = 1;
+    if (!pair)
+        return;
+    if (retired_n == retired_size)
+    {
+        size_t size = retired_size ? retired_size * 2 : 16;
+        char** r    = realloc (retired, size * sizeof *r);
+        if (!r)
+        {
+            /* Leaked rather than freed while environ may point to it */
+            return;
+        }
+        retired      = r;
+        retired_size = size;
+    }
+    retired[retired_n++] = pair;
+}
+
+/* Length of the variable name starting s, 0 if it does not start by one */
+size_t
+env_name_length (const char* s)
+{
+    size_t len = 0;
+
+    if (!(s[0] == '_' || (s[0] >= 'A' && s[0] <= 'Z')
+          || (s[0] >= 'a' && s[0] <= 'z')))
+        return 0;
+    while (s[len] == '_' || (s[len] >= 'A' && s[len] <= 'Z')
+           || (s[len] >= 'a' && s[len] <= 'z')
+           || (s[len] >= '0' && s[len] <= '9'))
+        ++len;
+    return len;
+}
+
+/* Import the environment of the shell, every variable exported */
+int
+env_init (void)
+{
+    for (char** e = environ; e && *e; ++e)
+    {
+        const char* eq = strchr (*e, '=');
+        if (eq && env_set (*e, eq - *e, eq + 1, 1) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Value of a variable of len characters, NULL if unset */
+const char*
+env_get (const char* name, size_t len)
+{
+    var_t* v;
+
+    if (!table_size || !(v = find_slot (name, len))->pair)
+        return NULL;
+    return v->pair + len + 1;
+}
+
+/* Set a variable, exported if export is non zero or if it already was */
+int
+env_set (const char* name, size_t len, const char* value, int export)
+{
+    size_t vlen = strlen (value);
+    char* pair;
+    var_t* v;
+
+    if ((table_used + 1) * 2 > table_size && grow_table () < 0)
+        return -1;
+    if ((pair = malloc (len + vlen + 2)) == NULL)
+        return -1;
+
+    memcpy (pair, name, len);
+    pair[len] = '=';
+    memcpy (pair + len + 1, value, vlen + 1);
+
+    v = find_slot (name, len);
+    if (!v->pair)
+    {
+        v->namelen  = len;
+        v->exported = 0;
+        ++table_used;
+    }
+    else if (!v->exported)
+        free (v->pair);
+
+    if (v->exported)
+        retire (v->pair);
+    else if (export)
+    {
+        v->exported = 1;
+        ++exported;
+        retire (NULL);
+    }
+
+    v->pair = pair;
+    return 0;
+}
+
+/* Non zero if a variable is exported */
+int
+env_exported (const char* name, size_t len)
+{
+    var_t* v;
+
+    if (!table_size || !(v = find_slot (name, len))->pair)
+        return 0;
+    return v->exported;
+}
+
+/* Export a variable, -1 if unset */
+int
+env_export (const char* name, size_t len)
+{
+    var_t* v;
+
+    if (!table_size || !(v = find_slot (name, len))->pair)
+        return -1;
+    if (!v->exported)
+    {
+        v->exported = 1;
+        ++exported;
+        retire (NULL);
+    }
+    return 0;
+}
+
+/* Remove a variable */
+void
+env_unset (const char* name, size_t len)
+{
+    size_t mask = table_size - 1;
+    size_t i, j;
+    var_t* v;
+
+    if (!table_size || !(v = find_slot (name, len))->pair)
+        return;
+
+    if (v->exported)
+    {
+        --exported;
+        retire (v->pair);
+    }
+    else
+        free (v->pair);
+    v->pair = NULL;
+    --table_used;
+
+    /* Move back the following entries of the run that belong before */
+    for (i = v - table, j = (i + 1) & mask; table[j].pair; j = (j + 1) & mask)
+    {
+        size_t home = hash_name (table[j].pair, table[j].namelen) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask))
+        {
+            table[i]      = table[j];
+            table[j].pair = NULL;
+            i             = j;
+        }
+    }
+}
+
+/* Environment of commands, up to date */
+char**
+env_envp (void)
+{
+    static char* empty[1] = {NULL};
+    size_t n              = 0;
+    char** e;
+
+    if (!stale)
+        return envp;
+
+    /* Allocation errors leave commands the previous environment */
+    if ((e = malloc ((exported + 1) * sizeof *e)) == NULL)
+        return environ ? environ : empty;
+
+    for (size_t i = 0; i < table_size; ++i)
+        if (table[i].pair && table[i].exported)
+            e[n++] = table[i].pair;
+    e[n]    = NULL;
+    environ = e;
+    stale   = 0;
+
+    /* Nothing points to them anymore */
+    free (envp);
+    envp = e;
+    for (size_t i = 0; i < retired_n; ++i)
+        free (retired[i]);
+    retired_n = 0;
+
+    return envp;
+}
+
+/* Order of variables */
+static int
+compare_pairs (const void* a, const void* b)
+{
+    return strcmp (*(char* const*) a, *(char* const*) b);
+}
+
+/* Print variables as "NAME=value", only exported ones as "export ..." */
+void
+env_print (FILE* out, int only_exported)
+{
+    char** sorted = malloc ((table_used + 1) * sizeof *sorted);
+    size_t n      = 0;
+
+    if (!sorted)
+        return;
+
+    for (size_t i = 0; i < table_size; ++i)
+        if (table[i].pair && (!only_exported || table[i].exported))
+            sorted[n++] = table[i].pair;
+    qsort (sorted, n, sizeof *sorted, compare_pairs);
+
+    for (size_t i = 0; i < n; ++i)
+        fprintf (out, only_exported ? "export %s\n" : "%s\n", sorted[i]);
+    free (sorted);
+}
@@ -0,0 +1,33 @@
+#ifndef _ENV_H
+#define _ENV_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* Shell variables, exported ones make the environment of commands */
+/* The environment is only rebuilt when an exported variable changed, it
+ * then also becomes environ */
+
+/* Import the environment of the shell, every variable exported */
+extern int env_init (void);
+/* Length of the variable name starting s, 0 if it does not start by one */
+extern size_t env_name_length (const char* s);
+/* Value of a variable of len characters, NULL if unset */
+extern const char* env_get (const char* name, size_t len);
+/* Set a variable, exported if export is non zero or if it already was */
+extern int env_set (const char* name,
+                    size_t len,
+                    const char* value,
+                    int export);
+/* Non zero if a variable is exported */
+extern int env_exported (const char* name, size_t len);
+/* Export a variable, -1 if unset */
+extern int env_export (const char* name, size_t len);
+/* Remove a variable */
+extern void env_unset (const char* name, size_t len);
+/* Environment of commands, up to date */
+extern char** env_envp (void);
+/* Print variables as "NAME=value", only exported ones as "export ..." */
+extern void env_print (FILE* out, int only_exported);
+
+#endif
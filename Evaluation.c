@@ -6,15 +6,6 @@
     + More error handling around wait and kill
     + Quit with jobs should warn or block
 
-    * cat < f1 | cat -n | tee f2 | cat -n | (sleep 4 && cat -n > f4)
-      Kinda works but hangs (pipe not closed), but ctrl-c then fg works to
-        resume and kill Same in non-interactive
-
-    * (sleep 2 && cat < f1) &
-      Does not print unless resumed (suspended by default TTOU)
-      Works wonderful in non-interactive
-      fg + ctrl-z fucks up everything
-
     - Check for async signal safe functions
     https://pubs.opengroup.org/onlinepubs/9699919799/functions/V2_chap02.html#tag_15_04_03_03
       Warn: shared varialbe is not async safe for signals
@@ -24,30 +15,79 @@
 
 #include "Evaluation.h"
 
+#include "Builtins.h"
+#include "Cache.h"
+#include "Env.h"
+#include "ForkServer.h"
+#include "Glob.h"
+#include "Hash.h"
+#include "History.h"
+#include "Placement.h"
 #include "Shell.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <math.h>
+#include <poll.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 /*=====================*/
 /* BEGIN DECLARATIONS  */
 /*=====================*/
 
+/* Environment given to spawned commands */
+extern char** environ;
+
 /* Pipe2 should be portable enough to not care, especially with
  * _XOPEN_SOURCE=700 */
 /* Linux >= 2.9
  * OpenBSD >= 5.7
  * FreeBSD >= 10.0
  * MacOS ... nothing */
+/* wait4 is BSD, it is everywhere but not in _XOPEN_SOURCE */
+extern pid_t wait4 (pid_t pid, int* wstatus, int options, struct rusage* ru);
+
+/* pidfds are Linux >= 5.3, without them processes are waited as before */
+#ifdef __linux__
+#include <sys/syscall.h>
+extern long syscall (long number, ...);
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_pidfd_send_signal
+#define SYS_pidfd_send_signal 424
+#endif
+/* memfd_create is Linux >= 3.17, its flags and seals are _GNU_SOURCE */
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x1U
+#define MFD_ALLOW_SEALING 0x2U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#define F_SEAL_SEAL 0x1
+#define F_SEAL_SHRINK 0x2
+#define F_SEAL_GROW 0x4
+#define F_SEAL_WRITE 0x8
+#endif
+/* splice moves pages between pipes without copying them, pipestats needs
+ * it */
+#include <sys/ioctl.h>
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE 0x1
+#define SPLICE_F_NONBLOCK 0x2
+#endif
+#endif
+
 #ifndef __APPLE_
 extern int pipe2 (int pipefd[2], int flags);
 #else
@@ -83,75 +123,59 @@ pipe2 (int pipefd[2], int flags)
             _status_ = _status_;                \
     } while (0)
 
-/* Command hash */
-#define CD 0x15d9 /* cd */
-#define CBG 0x1665 /* bg */
-#define CFG 0x1681 /* fg */
-#define HASH 0x47ee6 /* hash */
-#define HELP 0x4c151 /* help */
-#define ECHO 0x4b21d /* echo */
-#define EXIT 0x4e65e /* exit */
-#define JOBS 0x4d206 /* jobs */
-#define ECHO_STATUS 0xd0b /* $? */
-
-/* Help strings */
-static const char* internal_help[] = {
-    "cd [dir]",
-    "echo [$? | arg ...]",
-    "exit",
-    "hash [text]\t /!\\ Only adds each ASCII character!",
-    "fg [name]",
-    "bg [name]",
-    "help",
-    NULL};
+/*****************/
+/* Shell options */
+/*****************/
 
-/* Display help strings */
-static void
-dipslay_help (void)
+/* Options changed by "set" */
+static struct
 {
-    const char* str;
-    const char** array = internal_help;
-    fprintf (stdout,
-             "MiniShell - ProgSys 2020-21\nPierre Boisselier "
-             "<pierre.boisselier@etu.u-bordeaux.fr>\n\nThose shell commands "
-             "are defined "
-             "internally.\n\n");
-    while ((str = *array++))
-        fprintf (stdout, "\t%s\n", str);
-    fprintf (stdout, "\n");
-    fprintf (stdout,
-             "Keyboard shortcuts:\n\t- Ctrl-Z: Suspend current job in "
-             "foreground\n\t- Ctrl-C: Interrupt current foreground job\n\n");
-}
+    int pipefail;   /* A pipeline fails if any of its commands fails */
+    int pipebuf;    /* Buffer size of pipes, 0 for the kernel's default */
+    int forkserver; /* Commands are launched by the fork server */
+    int pipestats;  /* Pipelines report the throughput of their pipes */
+} shopt;
+
+/* Kind of values of an option */
+enum opt_t
+{
+    OPT_BOOL, /* on or off */
+    OPT_SIZE  /* Size in bytes, with an optional K, M or G suffix */
+};
 
-/*
- * Provides a basic hash function
- * Just adds every ASCII code
- * 100% cryptographically secure :)
- */
-static const int
-hash_cmd (const char* str)
+/* Description of an option */
+typedef struct option
 {
-    /* There shouldn't be any collisions, but still not really the best hash
-     * function */
-    int hash = 0;
-    int i    = 7;
-    int c;
-    while ((c = *str++))
-    {
-        hash = (hash + c * i) % INT_MAX;
-        i *= 7;
-    }
-    return hash;
-}
+    const char* name; /* Name given to "set" */
+    int type;         /* See opt_t */
+    int* value;       /* Where its value is stored */
+} option_t;
+
+/* All options, terminated by a NULL name */
+static const option_t options_list[] = {
+    {"pipefail", OPT_BOOL, &shopt.pipefail},
+    {"pipebuf", OPT_SIZE, &shopt.pipebuf},
+    {"forkserver", OPT_BOOL, &shopt.forkserver},
+    {"pipestats", OPT_BOOL, &shopt.pipestats},
+    {NULL, 0, NULL}};
+
+/* Parse a size, returns -1 if invalid */
+static int parse_size (const char* str, int* size);
 
 /***************/
 /* Job control */
 /***************/
 
-/* Design Choice: Using linked list for job control would be better.
- * However, this Shell being a "mini"-one there is no need for "unlimited" jobs.
- * MAXJOBS is enough. */
+/* Design Choice: Jobs are allocated by chunks of JOBCHUNK slots, so a job
+ * pointer stays valid when the table grows. The jid is the slot index.
+ * Free slots are kept in a list, live processes are indexed by pid and live
+ * jobs by name (chained hash tables), so registering, finding and removing a
+ * job does not depend on how many jobs there are.
+ * The fields read by scans over every slot (pid, pgid, state, status) are
+ * kept apart in arrays indexed by jid, a scan does not touch the slots.
+ * Names and command lines are interned in a pool, jobs refer to them by id;
+ * live jobs are also kept sorted by command line for "%prefix".
+ * A job is a process group: one process, or every stage of a pipeline. */
 
 /* There is WNOHANG but no WHANG and that's sad */
 #define WHANG 0
@@ -160,10 +184,35 @@ hash_cmd (const char* str)
 #define JFG 0
 /* Start in background */
 #define JBG 1
-/* Maximum number of concurrent jobs */
-#define MAXJOBS 32
-/* Size of command name buffer for each job */
-#define CMDBUFSZ 16
+/* Number of job slots allocated at once */
+#define JOBCHUNK 32
+/* Grow an array of job_hot to _slots_ entries, -1 if no memory */
+#define GROW_FIELD(_field_, _slots_) \
+    grow_field ((void**) &(_field_), sizeof *(_field_), _slots_)
+/* Fields of a job in the arrays of job_hot */
+#define JOB_PID(_job_) (job_hot.pid[(_job_)->jid])
+#define JOB_PGID(_job_) (job_hot.pgid[(_job_)->jid])
+#define JOB_STATE(_job_) (job_hot.state[(_job_)->jid])
+#define JOB_STATUS(_job_) (job_hot.status[(_job_)->jid])
+/* Size of the placement description of each job */
+#define PLACEBUFSZ 64
+/* Exit status of a job killed by "timeout", as coreutils */
+#define TIMEOUT_STATUS 124
+/* Seconds between SIGTERM and SIGKILL once a job timed out */
+#define TIMEOUT_GRACE 2
+/* Most pidfds polled at once */
+#define WAIT_FDS 64
+/* Period of checks for processes without pidfd */
+#define WAIT_BLIND_MS 50
+
+/* Steps of "timeout" */
+enum timeout_t
+{
+    TNONE,  /* No deadline */
+    TARMED, /* SIGTERM at the deadline */
+    TTERM,  /* SIGTERM sent, SIGKILL at the deadline */
+    TKILL   /* SIGKILL sent */
+};
 
 /* All states a job can be (and can dream of) */
 enum state_t
@@ -173,54 +222,198 @@ enum state_t
     JSTOPPED
 };
 
+/* A process of a job */
+typedef struct process
+{
+    pid_t pid;                /* pid */
+    int state;                /* See state_t */
+    int status;               /* Exit status */
+    int termsig;              /* If > 0, the signal received is here */
+    int pidfd;                /* pidfd of the process, -1 if none */
+    struct job* job;          /* Job of this process */
+    struct process* next_pid; /* Next process in the same pid bucket */
+} process_t;
+
+/* Pid, pgid, state and status are in job_hot, see JOB_PID */
 typedef struct job
 {
-    int jid;            /* Job id */
-    pid_t pid;          /* pid, if 0 then free slot */
-    pid_t pgid;         /* Group pid */
-    int background;     /* Is in background? */
-    int state;          /* See state_t */
-    int status;         /* Return status, -1 by default */
-    int termsig;        /* If > 0, the signal received is here */
-    char cmd[CMDBUFSZ]; /* Only 16 first characters of cmd */
+    int jid;                /* Job id */
+    int background;         /* Is in background? */
+    int termsig;            /* If > 0, the signal received is here */
+    int name;               /* Id of its first command in the pool */
+    int line;               /* Id of its command line in the pool */
+    char place[PLACEBUFSZ]; /* Where it runs, see "on" */
+
+    struct timespec start; /* Registration time, CLOCK_MONOTONIC */
+    struct timespec end;   /* Time it was done */
+    struct rusage usage;   /* Usage of its processes done */
+    int timeout;              /* See timeout_t */
+    struct timespec deadline; /* Next step of timeout, CLOCK_MONOTONIC */
+    int report;               /* Report of pipestats to print, -1 if none */
+
+    process_t* procs; /* Processes, from left to right for a pipeline */
+    int nprocs;       /* Number of processes */
+    process_t proc;   /* Storage of procs for a single process */
+
+    struct job* next_name; /* Next job in the same name bucket */
+    struct job* next_free; /* Next free slot */
 } job_t;
 
+/* A string of the pool */
+typedef struct pooled
+{
+    char* s;     /* The string, NULL if the entry is free */
+    size_t hash; /* FNV-1a of s */
+    int refs;    /* Number of jobs using it */
+    int next;    /* Next entry of its bucket, or next free entry */
+} pooled_t;
+
+/* Interned strings, chained hash table of entries found by id */
+typedef struct string_pool
+{
+    pooled_t* entries; /* Entries, an id is an index */
+    int size;          /* Number of entries */
+    int* buckets;      /* First entry of each bucket, -1 if none */
+    int nbuckets;      /* Number of buckets, a power of two */
+    int free;          /* First free entry, -1 if none */
+} string_pool_t;
+
+/* Fields of every slot, indexed by jid */
+typedef struct job_fields
+{
+    pid_t* pid;           /* pid of the first process, if 0 then free slot */
+    pid_t* pgid;          /* Group pid */
+    unsigned char* state; /* See state_t */
+    int* status;          /* Return status */
+} job_fields_t;
+
+/* Chained hash table of jobs */
+typedef struct job_index
+{
+    job_t** buckets; /* Heads of chains, size is a power of two */
+    size_t size;     /* Number of buckets */
+} job_index_t;
+
+/* Chained hash table of processes */
+typedef struct proc_index
+{
+    process_t** buckets; /* Heads of chains, size is a power of two */
+    size_t size;         /* Number of buckets */
+} proc_index_t;
+
 /* Shell PID */
 static int shpid;
 /* Flag set when init_shell was ran*/
 static int init_flag = 0;
 /* Interactive mode flag */
 static int interactive = 1;
+/* Set in a forked shell (background sequence, pipeline stage): commands stay
+ * in its process group and the parent shell does the job control */
+static int subshell = 0;
+/* Set when the process ends with the expression it runs: its last command,
+ * if external, is executed in place rather than forked and waited for */
+static int tail_exec = 0;
 
 /* See Design Choice above */
-static job_t job_list[MAXJOBS];
+/* All slots, indexed by jid */
+static job_t** job_list = NULL;
+/* Number of slots in job_list */
+static int job_slots = 0;
+/* Number of live jobs */
+static int job_count = 0;
+/* Number of live processes */
+static int proc_count = 0;
+/* Free slots */
+static job_t* free_jobs = NULL;
+/* Live processes by pid */
+static proc_index_t pid_index;
+/* Live jobs by name */
+static job_index_t name_index;
+/* Hot fields of every slot */
+static job_fields_t job_hot;
+/* Names and command lines of jobs */
+static string_pool_t pool = {NULL, 0, NULL, 0, -1};
+/* Live jobs sorted by command line, then by jid */
+static job_t** job_order = NULL;
 /* Last background job started */
-static job_t* last_job = job_list;
+static job_t* last_job = NULL;
 /* Current foreground job */
 static job_t* fg_job = NULL;
+/* Usage of processes done while a "time" runs, NULL otherwise */
+static struct rusage* timed_usage = NULL;
+/* Placement given by "on" without a command */
+static placement_t placement_default;
+/* Placement of commands being launched, NULL if none */
+static const placement_t* placement_cur = NULL;
+/* Deadline of commands being launched, NULL if none */
+static const struct timespec* deadline_cur = NULL;
+/* Command line of commands being launched if not their arguments, as with
+ * redirections */
+static const char* line_cur = NULL;
+/* Number of jobs with a deadline */
+static int deadline_jobs = 0;
 
 /* Initialize shell */
 static int init_shell (void);
-/* Register a job */
-static job_t* register_job (pid_t pid, pid_t pgid, int background, char* cmd);
+/* Intern a string, returns its id or -1 */
+static int pool_intern (const char* s);
+/* Id of an interned string, -1 if it is not */
+static int pool_find (const char* s);
+/* A user of an interned string is gone */
+static void pool_release (int id);
+/* Text of a job, an expression or the arguments of a command, in the
+ * arena */
+static const char* job_line (const Expression* e, char** argv);
+/* Register a job of n processes, named and with its command line */
+static job_t* register_job (const pid_t* pids,
+                            int n,
+                            pid_t pgid,
+                            int background,
+                            const char* name,
+                            const char* line);
 /* Start a job */
 static void launch_job (job_t* job, int notify);
 /* Unregister a job */
 static void unregister_job (job_t* job);
 /* Remove jobs done */
 static void remove_old_jobs (int notify);
-/* Find a job from a pid */
-static job_t* find_job (pid_t pid);
+/* Find a process from a pid */
+static process_t* find_proc (pid_t pid);
+/* Find a job from its name */
+static job_t* find_job_name (const char* cmd);
+/* Most recent job not done, NULL if none */
+static job_t* current_job (void);
+/* Find a job from "%jid", "%prefix", "%?text", "jid" or its name, sets
+ * ambiguous if more than one matches */
+static job_t* find_job_arg (const char* arg, int* ambiguous);
 /* Suspend a job with ctrl-z */
 static void suspend_job (job_t* job);
-/* Set the exit status of a job */
-static inline void set_status_job (job_t* job, int wstatus);
+/* Continue a stopped job */
+static void continue_job (job_t* job);
+/* Set the exit status of a process, and the state of its job */
+static void set_status_proc (process_t* proc,
+                             int wstatus,
+                             const struct rusage* ru);
+/* Add a usage to another one */
+static void add_usage (struct rusage* to, const struct rusage* ru);
+/* pidfd of a process, -1 if unsupported */
+static int open_pidfd (pid_t pid);
+/* Send a signal to every process of a job */
+static void signal_job (job_t* job, int signo);
+/* Signal jobs past their deadline, returns the milliseconds until the
+ * next one, -1 if none */
+static int check_deadlines (void);
+/* Wait until a child changes state, through the pidfds of the jobs given,
+ * or until the next deadline */
+static void wait_children (job_t* const* jobs, int n, int flags);
 /* Send to foregound (and continue) */
 static void send_to_foreground (job_t* job);
 /* Send to background (and continue) */
 static void send_to_background (job_t* job);
 /* Display a job */
 static void display_job (const job_t* job);
+/* Display times of a job */
+static void display_usage (const job_t* job);
 
 /*******************/
 /* Signal handling */
@@ -233,12 +426,23 @@ static struct sigaction sigact, sigdfl;
 /* All signals used to be registered/unregistered */
 static int sigregistered[] = {SIGCHLD, SIGINT, SIGTSTP, SIGTTIN, SIGTTOU, -1};
 
+/* Self-pipe written by SIGCHLD handler, drained by grim_reaper */
+static int sigchld_pipe[2] = {-1, -1};
+/* File catching the output of internal commands run in a pipeline */
+static int capture_fd = -1;
+/* Set by SIGINT, for internal commands waiting for many jobs */
+static volatile sig_atomic_t sigint_flag = 0;
+
+/* Create the self-pipe for SIGCHLD */
+static int init_reaper (void);
 /* Register signals */
 static void register_signals (struct sigaction* sig);
 /* Signal handler */
 static void sig_handler (int signo);
 /* Reap zombies */
 static void grim_reaper (void);
+/* Reap children that changed state, flags are those of wait4 */
+static void reap_children (int flags);
 
 /****************/
 /* Redirections */
@@ -246,14 +450,114 @@ static void grim_reaper (void);
 
 /* Flags for redirection modes */
 /* O_CLOEXEC is defined in POSIX.1-2008, _X_OPEN_SOURCE >= 700 */
-#define O_OUT O_WRONLY | O_CREAT | O_CLOEXEC | O_TRUNC
-#define O_IN O_RDONLY | O_CLOEXEC
+#define O_OUT (O_WRONLY | O_CREAT | O_CLOEXEC | O_TRUNC)
+#define O_IN (O_RDONLY | O_CLOEXEC)
 #define S_MODE 0666
 
+/* Environment variable giving the default of "set pipebuf" */
+#define PIPEBUF_ENV "MINISHELL_PIPEBUF"
+/* Environment variable starting the fork server, as "set forkserver on" */
+#define FORKSERVER_ENV "MINISHELL_FORKSERVER"
+/* Maximum size of a pipe for unprivileged users */
+#define PIPEBUF_MAX "/proc/sys/fs/pipe-max-size"
+
+/* Not given by _XOPEN_SOURCE */
+#if defined(__linux__) && !defined(F_SETPIPE_SZ)
+#define F_SETPIPE_SZ 1031
+#endif
+
+/* A stage of a pipeline */
+typedef struct stage
+{
+    const Expression* e; /* Expression run by the stage */
+    char** argv;         /* Arguments of a simple command, prefix removed */
+} stage_t;
+
+/* Free space kept for each read of the output of a $(...) */
+#define SUBST_CHUNK (1 << 16)
+
+/* Buffer of an expansion, grown in the arena of the line */
+typedef struct expbuf
+{
+    char* s;    /* Expanded argument, '\0' terminated */
+    size_t len; /* Its length */
+    size_t cap; /* Size of s */
+} expbuf_t;
+
+/* Most bytes moved by one splice of the pipe monitor */
+#define RELAY_CHUNK (1 << 16)
+/* A pipe full for this part of the time slows its pipeline down */
+#define RELAY_FULL 0.5
+
+/* A pipe between two stages, seen by the monitor of "set pipestats" */
+typedef struct relay
+{
+    int src;               /* Written by the stage before, -1 once closed */
+    int dst;               /* Read by the stage after */
+    int full;              /* Data waits for the stage after */
+    long long bytes;       /* Bytes relayed */
+    struct timespec since; /* When it became full */
+    double full_time;      /* Seconds spent full */
+    double end;            /* Seconds until it closed */
+} relay_t;
+
+/* A file (or another fd) given to a file descriptor */
+typedef struct redir
+{
+    const char* path; /* File to open, NULL to duplicate from */
+    int flags;        /* Flags of open */
+    int fd;           /* Redirected file descriptor */
+    int from;         /* File descriptor duplicated if no path */
+} redir_t;
+
+/* Redirections of an expression, only applied in the child */
+typedef struct redir_plan
+{
+    redir_t* redirs;       /* Applied in order */
+    int n;                 /* Number of redirections */
+    const Expression* cmd; /* Redirected expression */
+} redir_plan_t;
+
+/* Create a pipe with the given buffer size */
+static int make_pipe (int pipefd[2], int size);
+/* Create n pipes, none is left open on error */
+static int make_pipes (int (*pipes)[2], int n, int size);
+/* Close both ends of n pipes */
+static void close_pipes (int (*pipes)[2], int n);
 /* Launch jobs as pipelines */
-static int lay_pipeline (const Expression* e, int options);
+static int lay_pipeline (const Expression* e, int options, int notify);
+/* Relay the pipes of a pipeline and write their throughput to report,
+ * never returns */
+static void run_pipestats (const stage_t* stages,
+                           int n,
+                           int (*pipes)[2],
+                           int (*relays)[2],
+                           int report);
+/* Print the report of pipestats once the job is done */
+static void show_report (job_t* job);
+/* Compile a chain of redirections into a plan */
+static void compile_redirections (const Expression* e, redir_plan_t* plan);
+/* Close the fds of here-documents once the plan was applied by children */
+static void release_plan (const redir_plan_t* plan);
+/* Read end of the text of "<<<" or "<<", -1 on error */
+static int here_document (const Expression* e);
+/* A file descriptor reading text, -1 on error */
+static int here_fd (const char* text, size_t len);
+/* Apply a plan to the current process */
+static int apply_plan (const redir_plan_t* plan);
+/* Turn a plan into posix_spawn file actions */
+static int plan_actions (const redir_plan_t* plan,
+                         posix_spawn_file_actions_t* actions);
 /* Launch jobs with redirections */
-static int lay_redirection (const Expression* e, int options);
+static int lay_redirection (const Expression* e, int options, int notify);
+/* Run a stage of a pipeline in its forked process */
+static void run_stage (const stage_t* stage);
+/* Run an internal command in the shell, its output is kept in the arena */
+static int capture_internal (char** argv, char** out, size_t* len);
+/* Write without blocking, returns the number of bytes written */
+static size_t write_some (int fd, const char* buf, size_t len);
+/* Setup of a forked child running an expression */
+static void enter_subshell (void);
 
 /****************/
 /* Command exec */
@@ -261,17 +565,155 @@ static int lay_redirection (const Expression* e, int options);
 
 /* Job control commands (fg & bg) */
 static int cmd_jobctrl (char* job_cmd, int bg);
+/* Internal commands, see Builtins.def */
+static int cmd_cd (char** argv);
+static int cmd_echo (char** argv);
+static int cmd_exit (char** argv);
+static int cmd_hash (char** argv);
+static int cmd_fg (char** argv);
+static int cmd_bg (char** argv);
+static int cmd_jobs (char** argv);
+static int cmd_help (char** argv);
+static int cmd_set (char** argv);
+static int cmd_parallel (char** argv);
+static int cmd_history (char** argv);
+static int cmd_export (char** argv);
+static int cmd_unset (char** argv);
+static int cmd_wait (char** argv);
+
+/* A command line run by "parallel" */
+typedef struct task
+{
+    job_t* job;       /* Its job while it runs */
+    int status;       /* Exit status once done */
+    int done;         /* Finished, or never started */
+    int fd;           /* Output kept with --keep-order, -1 otherwise */
+    const char* path; /* File of fd, removed once done */
+} task_t;
+
+/* Every internal command, in the order of "help" */
+static const builtin_t builtins_list[] = {
+#define BUILTIN(name, handler, flags, help) {#name, handler, flags, help},
+#include "Builtins.def"
+#undef BUILTIN
+};
+
+/* Perfect hash table of builtins_list, generated by mkbuiltins */
+#include "BuiltinsTable.h"
+
+/* Help of prefixes, they are not commands by themselves */
+static const char* prefix_help[] = {
+    "pipebuf size cmd | ...",
+    "time cmd | ...",
+    "on [cpus=list numa=node nice=n sched=policy cgroup=dir] [cmd | ...]",
+    "timeout secs[smhd] cmd | ...",
+    NULL};
+
+/* Find an internal command */
+static const builtin_t* find_builtin (const char* cmd);
 /* Internal commands */
 static int internal_cmd (char* cmd, char** argv);
+/* Internal commands, redirected in the shell itself */
+static int redirect_internal (char* cmd, char** argv, const redir_plan_t* plan);
+/* Spawn an external command without forking the shell */
+static pid_t spawn_cmd (const char* path,
+                        char** argv,
+                        const posix_spawn_file_actions_t* actions);
+/* Launch an external command through the fork server */
+static pid_t server_cmd (const char* path,
+                         char** argv,
+                         const redir_plan_t* plan);
+/* Start or stop the fork server as "set forkserver" says */
+static int update_forkserver (void);
+/* Execute an external command in the current process, never returns */
+static void exec_cmd (const char* path, char* cmd, char** argv);
+/* Arguments with their variables and patterns expanded, argv itself if
+ * there are none */
+static char** expand_arguments (char** argv);
+/* Expand the variables and commands of an argument, in the arena; if
+ * split, blanks output by the commands become '\0' */
+static char* expand_variables (const char* s, size_t* len, int split);
+/* Make room for n more characters in an expansion */
+static void expbuf_reserve (expbuf_t* b, size_t n);
+/* Append n characters to an expansion */
+static void expbuf_append (expbuf_t* b, const char* s, size_t n);
+/* The ')' closing a "$(" just before s, NULL if none */
+static const char* subst_end (const char* s);
+/* Append the output of a command of n characters to an expansion */
+static void substitute (const char* text, size_t n, expbuf_t* b, int split);
+/* Add a field of an expanded argument, or the paths it matches */
+static char** add_field (char** list, char* field, int pattern);
+/* Non zero if s is "NAME=value" */
+static int is_assignment (const char* s);
+/* Set the variables of the first n arguments, exported if export */
+static int assign_variables (char** argv, int n, int export);
+/* Launch "NAME=value ... cmd", or set the variables without cmd */
+static int start_assigned (char** argv,
+                           int options,
+                           int notify,
+                           const redir_plan_t* plan);
 /* Launch a "SIMPLE" command (node) */
-static int start_cmd (char* cmd, char** argv, int options, int notify);
+static int start_cmd (char* cmd,
+                      char** argv,
+                      int options,
+                      int notify,
+                      const redir_plan_t* plan);
+/* Parse "on key=value ...", returns the index of the command or -1 */
+static int parse_placement (char** argv, placement_t* p);
+/* Launch "on key=value ... cmd", or change the defaults without cmd */
+static int start_placed (char** argv,
+                         int options,
+                         int notify,
+                         const redir_plan_t* plan);
+/* Parse "secs[smhd]" into the deadline it gives from now, -1 if invalid */
+static int parse_deadline (const char* str, struct timespec* deadline);
+/* Launch "timeout secs cmd", its job is killed at the deadline */
+static int start_timed (char** argv,
+                        int options,
+                        int notify,
+                        const redir_plan_t* plan);
 
 /**********************/
 /* Expression handler */
 /**********************/
 
+/* Instructions of a compiled expression */
+enum op_code
+{
+    OP_SPAWN,    /* Simple command */
+    OP_PIPE,     /* Pipeline, as one job */
+    OP_REDIRECT, /* Redirected expression */
+    OP_BG,       /* Expression in background */
+    OP_TIME,     /* Timed expression */
+    OP_IF_OK,    /* Jump to target if the status is 0 (||) */
+    OP_IF_FAIL   /* Jump to target if the status is not 0 (&&) */
+};
+
+typedef struct op
+{
+    int code;            /* See op_code */
+    int target;          /* Next instruction of a jump */
+    const Expression* e; /* Expression of the instruction */
+} op_t;
+
+/* Sequences of an expression lowered to a flat array, run by a loop */
+typedef struct program
+{
+    int n;      /* Number of instructions */
+    op_t ops[]; /* Instructions */
+} program_t;
+
+/* Lower the sequences of an expression, malloc'd, NULL on error */
+static program_t* compile_program (const Expression* e);
+/* Run a program, notify only matters for a single instruction */
+static int run_program (const program_t* p, int notify);
+/* Run an expression in the foreground without recursion on sequences,
+ * reusing the program of a cached tree */
+static int run_expression (const Expression* e, int notify);
 /* Recursive handler */
 static int expression_handler (const Expression* e, int options, int notify);
+/* Run an expression and display its times */
+static int time_expression (const Expression* e, int options, int notify);
 
 /*======================*/
 /* BEGIN IMPLEMENTATION */
@@ -285,6 +727,10 @@ static int expression_handler (const Expression* e, int options, int notify);
 static int
 init_shell (void)
 {
+    /* Variables of the shell, from its environment */
+    if (env_init () < 0)
+        return -1;
+
     /* Prepare our handlers */
     sigemptyset (&sigact.sa_mask);
     /* Prevent I/O primitives from terminating earlier with EINTR */
@@ -296,12 +742,39 @@ init_shell (void)
     sigdfl.sa_flags   = 0;
     sigdfl.sa_handler = SIG_DFL;
 
+    /* Children are reaped outside of the signal handler */
+    if (init_reaper () < 0)
+        return -1;
+
+    /* Default size of pipes */
+    const char* pipebuf = getenv (PIPEBUF_ENV);
+    if (pipebuf && parse_size (pipebuf, &shopt.pipebuf) < 0)
+        fprintf (stderr, "%s: invalid size: %s\n", PIPEBUF_ENV, pipebuf);
+
+    /* Forked now, while the shell is small */
+    const char* forkserver = getenv (FORKSERVER_ENV);
+    if (forkserver && *forkserver && strcmp (forkserver, "0") != 0)
+    {
+        shopt.forkserver = 1;
+        update_forkserver ();
+    }
+
+    /* Batch mode has no job control: commands stay in our group as in a
+     * subshell, signals keep their default action but SIGCHLD */
+    if (!interactive_mode)
+    {
+        interactive = 0;
+        subshell    = 1;
+        shpid       = getpid ();
+        if (sigaction (SIGCHLD, &sigact, NULL) < 0)
+            return -1;
+        init_flag = 1;
+        return 0;
+    }
+
     /* Register signals */
     register_signals (&sigact);
 
-    /* Clear all jobs*/
-    memset (job_list, 0, sizeof job_list);
-
     /* Get our own group */
     shpid = getpid ();
     if (setpgid (shpid, shpid) < 0)
@@ -318,704 +791,3951 @@ init_shell (void)
     return 0;
 }
 
-/* Register a new job */
-static job_t*
-register_job (pid_t pid, pid_t pgid, int background, char* cmd)
+/* Bucket of a pid */
+static inline size_t
+pid_bucket (pid_t pid, size_t size)
 {
-    /* Find a free job in the array */
-    for (int i = 0; i < MAXJOBS; ++i)
-        if (job_list[i].pid == 0)
-        {
-            job_list[i].jid        = i;
-            job_list[i].pid        = pid;
-            job_list[i].pgid       = pgid;
-            job_list[i].background = background;
-            job_list[i].state      = JRUNNING;
-
-            /* Store the command argument */
-            if (cmd)
-                for (int j = 0; j < CMDBUFSZ; ++j)
-                {
-                    job_list[i].cmd[j] = cmd[j];
-                    if (cmd[j] == '\0')
-                        break;
-                }
-
-            return &job_list[i];
-        }
+    /* Pids are mostly sequential, spread them */
+    return ((size_t) pid * 2654435761u) & (size - 1);
+}
 
-    /* Cannot find a free job to use */
-    return NULL;
+/* FNV-1a of a string */
+static inline size_t
+string_hash (const char* s)
+{
+    size_t h = 2166136261u;
+    while (*s)
+        h = (h ^ (unsigned char) *s++) * 16777619u;
+    return h;
 }
 
-/* Launch a job  */
-static void
-launch_job (job_t* job, int notify)
+/* Bucket of a job name, from the pool */
+static inline size_t
+name_bucket (int name, size_t size)
 {
-    assert (job);
+    return pool.entries[name].hash & (size - 1);
+}
 
-    /* Always start in stopped mode */
-    job->state = JSTOPPED;
+/* Id of an interned string, -1 if it is not */
+static int
+pool_find (const char* s)
+{
+    size_t h = string_hash (s);
+    int id;
 
-    /* Assign its own group */
-    setpgid (job->pid, job->pid);
+    if (!pool.nbuckets)
+        return -1;
 
-    if (job->background == JFG)
-        send_to_foreground (job);
-    else
-    {
-        send_to_background (job);
-        if (notify)
-            fprintf (stdout, "[%d] %d\n", job->jid, job->pid);
-    }
+    id = pool.buckets[h & (pool.nbuckets - 1)];
+    while (id >= 0 && (pool.entries[id].hash != h
+                       || strcmp (pool.entries[id].s, s) != 0))
+        id = pool.entries[id].next;
+    return id;
 }
 
-/* Unregister job */
-static void
-unregister_job (job_t* job)
+/* Double the entries of the pool, its buckets follow */
+static int
+grow_pool (void)
 {
-    assert (job);
-    job->pid     = 0;
-    job->jid     = 0;
-    job->status  = 0;
-    job->termsig = 0;
-}
+    int size          = pool.size ? pool.size * 2 : JOBCHUNK;
+    pooled_t* entries = realloc (pool.entries, size * sizeof *entries);
+    int* buckets;
 
-/* Remove old jobs */
-static void
-remove_old_jobs (int notify)
-{
-    for (int i = 0; i < MAXJOBS; ++i)
-        if (job_list[i].pid != 0 && job_list[i].state == JDONE)
+    if (entries == NULL)
+        return -1;
+    pool.entries = entries;
+    if ((buckets = malloc (size * sizeof *buckets)) == NULL)
+        return -1;
+
+    /* New entries are free, the lowest first */
+    for (int i = size - 1; i >= pool.size; --i)
+    {
+        entries[i].s    = NULL;
+        entries[i].next = pool.free;
+        pool.free       = i;
+    }
+
+    /* Rehash used ones */
+    for (int i = 0; i < size; ++i)
+        buckets[i] = -1;
+    for (int i = 0; i < pool.size; ++i)
+        if (entries[i].s)
         {
-            /* We do not want to notify for foreground jobs */
-            if (notify && job_list[i].background == JBG)
-                display_job (&job_list[i]);
-            unregister_job (&job_list[i]);
+            size_t b        = entries[i].hash & (size - 1);
+            entries[i].next = buckets[b];
+            buckets[b]      = i;
         }
-}
 
-/* Find a job from a pid */
-static job_t*
-find_job (pid_t pid)
-{
-    for (int i = 0; i < MAXJOBS; ++i)
-        if (job_list[i].pid == pid)
-            return &job_list[i];
-    return NULL;
+    free (pool.buckets);
+    pool.buckets  = buckets;
+    pool.nbuckets = size;
+    pool.size     = size;
+    return 0;
 }
 
-/* Suspend a job using TSTP */
-static void
-suspend_job (job_t* job)
+/* Intern a string, returns its id or -1 */
+static int
+pool_intern (const char* s)
 {
-    assert (job);
+    int id = pool_find (s);
+    size_t b;
 
-    /* Send Terminal Stop to job */
-    if (kill (job->pid, SIGTSTP) < 0)
-        perror ("Unable to send TSTP");
+    if (id >= 0)
+    {
+        ++pool.entries[id].refs;
+        return id;
+    }
 
-    job->state      = JSTOPPED;
-    job->background = JBG;
+    if (pool.free < 0 && grow_pool () < 0)
+        return -1;
 
-    last_job = job;
+    id = pool.free;
+    if ((pool.entries[id].s = strdup (s)) == NULL)
+        return -1;
+    pool.free = pool.entries[id].next;
+
+    pool.entries[id].hash = string_hash (s);
+    pool.entries[id].refs = 1;
+    b                     = pool.entries[id].hash & (pool.nbuckets - 1);
+    pool.entries[id].next = pool.buckets[b];
+    pool.buckets[b]       = id;
+    return id;
 }
 
-/* Send a job to foreground */
+/* A user of an interned string is gone, it is freed with the last one */
 static void
-send_to_foreground (job_t* job)
+pool_release (int id)
 {
-    assert (job);
-
-    /* Set default handler to all signals */
-    /* This is to prevent re-entering and f'ing up some apps */
-    register_signals (&sigdfl);
-
-    /* Give the terminal back to the job */
-    if (interactive)
-        tcsetpgrp (0, job->pid);
-
-    /* Set current foreground job */
-    fg_job = job;
-
-    /* Send SIGCONT if in stopped state */
-    if (job->state == JSTOPPED)
-        if (kill (job->pid, SIGCONT) < 0)
-            fprintf (stderr,
-                     "Unable to send continue to job %d: %s\n",
-                     job->jid,
-                     strerror (errno));
+    pooled_t* entry = &pool.entries[id];
+    int* p;
 
-    /* Wait for job to finish or stopped by user */
-    if (waitpid (job->pid, &job->status, WUNTRACED) < 0)
-        perror ("Wait foregroud job");
+    if (--entry->refs > 0)
+        return;
 
-    /* Set exit status to job */
-    set_status_job (job, job->status);
-
-    /* Re-register signal */
-    register_signals (&sigact);
+    p = &pool.buckets[entry->hash & (pool.nbuckets - 1)];
+    while (*p != id)
+        p = &pool.entries[*p].next;
+    *p = entry->next;
 
-    /* Give back terminal to shell */
-    if (interactive)
-        tcsetpgrp (0, shpid);
+    free (entry->s);
+    entry->s    = NULL;
+    entry->next = pool.free;
+    pool.free   = id;
 }
 
-/* Send a job to background (and resume it) */
-static void
-send_to_background (job_t* job)
+/* Interned string of an id */
+static inline const char*
+pool_string (int id)
 {
-    assert (job);
-
-    /* Send SIGCONT if in stopped state */
-    if (job->state == JSTOPPED)
-        if (kill (job->pid, SIGCONT) < 0)
-            fprintf (stderr,
-                     "Unable to send continue to job %d: %s\n",
-                     job->jid,
-                     strerror (errno));
-
-    job->state = JRUNNING;
-    last_job   = job;
+    return pool.entries[id].s;
 }
 
-/* Display a job */
-static void
-display_job (const job_t* job)
+/* Index in job_order of the first live job not before (line, jid), which
+ * is sorted by command line, then by jid */
+static int
+order_search (const char* line, int jid)
 {
-    assert (job);
+    int lo = 0;
+    int hi = job_count;
 
-    char* strstate = "Running";
-    if (job->state == JDONE)
-        strstate = "Done";
-    else if (job->state == JSTOPPED)
-        strstate = "Suspended";
+    while (lo < hi)
+    {
+        int mid          = lo + (hi - lo) / 2;
+        const job_t* job = job_order[mid];
+        int c            = strcmp (pool_string (job->line), line);
 
-    fprintf (stdout,
-             "[%d]+ %s\t%s\tPID: %d",
-             job->jid,
-             strstate,
-             job->cmd,
-             job->pid);
-    if (job->state == JDONE)
-        if (job->termsig)
-            fprintf (stdout, "\tTerminated with signal %d\n", job->termsig);
+        if (c < 0 || (c == 0 && job->jid < jid))
+            lo = mid + 1;
         else
-            fprintf (stdout, "\tExit %d\n", job->status);
-    else
-        fprintf (stdout, "\n");
+            hi = mid;
+    }
+    return lo;
 }
 
-/*******************
- * Signal Handling *
- *******************/
-
-/* Register signals used by the program */
+/* Append the arguments of a command, separated by spaces */
 static void
-register_signals (struct sigaction* sig)
+args_text (char** argv, expbuf_t* b)
 {
-    assert (sig);
-
-    /* All signals are in a list terminated by -1 */
-    for (int* s = sigregistered; *s != -1; s++)
-        if (sigaction (*s, sig, NULL) != 0)
-            goto err;
-
-    return;
+    for (int i = 0; argv[i]; ++i)
+    {
+        if (i)
+            expbuf_append (b, " ", 1);
+        expbuf_append (b, argv[i], strlen (argv[i]));
+    }
+}
 
-err:
-    perror ("Unable to register signals");
+/* Binding of an expression, its operand is in parentheses if it binds
+ * less */
+static int
+expression_rank (const Expression* e)
+{
+    switch (e->type)
+    {
+        case SEQUENCE:
+        case BG:
+            return 0;
+        case SEQUENCE_ET:
+        case SEQUENCE_OU:
+            return 1;
+        case PIPE:
+            return 2;
+        default:
+            return 3;
+    }
 }
 
-/* Signal handler */
+/* Append an expression as it could be typed again */
 static void
-sig_handler (int signo)
+expression_text (const Expression* e, int rank, expbuf_t* b)
 {
-    job_t* jb;
-    switch (signo)
+    /* Symbols of binary expressions then redirections, by type */
+    static const char* symbols[] = {
+        [SEQUENCE]       = " ; ",
+        [SEQUENCE_ET]    = " && ",
+        [SEQUENCE_OU]    = " || ",
+        [PIPE]           = " | ",
+        [REDIRECTION_I]  = " < ",
+        [REDIRECTION_O]  = " > ",
+        [REDIRECTION_A]  = " >> ",
+        [REDIRECTION_E]  = " 2> ",
+        [REDIRECTION_EO] = " &> ",
+        [REDIRECTION_HS] = " <<< ",
+        [REDIRECTION_HD] = " << "};
+    int own = expression_rank (e);
+
+    if (own < rank)
+        expbuf_append (b, "(", 1);
+
+    switch (e->type)
     {
-        /* Reap child */
-        case SIGCHLD:
-            grim_reaper ();
+        case VIDE:
             break;
-
-        /* Send INT to foreground job */
-        case SIGINT:
-            if (!fg_job)
-                break;
-            if (kill (fg_job->pid, SIGINT) < 0)
-                perror ("Unable to send SIGINT to foreground process");
+        case SIMPLE:
+            args_text (e->arguments, b);
             break;
-
-        /* Suspend current foreground job */
-        case SIGTSTP:
-            if (fg_job)
-                suspend_job (fg_job);
+        case SEQUENCE:
+        case SEQUENCE_ET:
+        case SEQUENCE_OU:
+        case PIPE:
+            expression_text (e->gauche, own, b);
+            /* "a & b" rather than "a & ; b" */
+            if (e->type == SEQUENCE && e->gauche->type == BG)
+                expbuf_append (b, " ", 1);
+            else
+                expbuf_append (b, symbols[e->type], strlen (symbols[e->type]));
+            expression_text (e->droite, own, b);
             break;
-
-        /* Get back control of the terminal */
-        // TODO: Sequence with stdout being suspended
-        case SIGTTIN:
-        case SIGTTOU:
-            tcsetpgrp (0, shpid);
+        case BG:
+            expression_text (e->gauche, own, b);
+            expbuf_append (b, " &", 2);
+            break;
+        case CHRONO:
+            expbuf_append (b, "time ", 5);
+            expression_text (e->gauche, own, b);
             break;
+        default:
+            /* Only the file, or the delimiter of a document */
+            expression_text (e->gauche, own, b);
+            expbuf_append (b, symbols[e->type], strlen (symbols[e->type]));
+            expbuf_append (b, e->arguments[0], strlen (e->arguments[0]));
     }
+
+    if (own < rank)
+        expbuf_append (b, ")", 1);
 }
 
-/* Change status of jobs */
-static inline void
-set_status_job (job_t* job, int wstatus)
+/* Text of a job, an expression or the arguments of a command, in the
+ * arena */
+static const char*
+job_line (const Expression* e, char** argv)
 {
-    assert (job);
+    expbuf_t b = {NULL, 0, 0};
 
-    if (WIFEXITED (wstatus))
-    {
-        job->status = WEXITSTATUS (wstatus);
-        job->state  = JDONE;
-    }
-    else if (WIFSTOPPED (wstatus))
-    {
-        job->status = 0;
-        job->state  = JSTOPPED;
-    }
-    else if (WIFSIGNALED (wstatus))
-    {
-        job->state   = JDONE;
-        job->termsig = WTERMSIG (wstatus);
-    }
+    expbuf_reserve (&b, 0);
+    if (argv)
+        args_text (argv, &b);
+    else
+        expression_text (e, 0, &b);
+    return b.s;
 }
 
-/* Reap zombie processes */
+/* Double the number of buckets of the pid index */
+static int
+grow_pid_index (void)
+{
+    size_t size          = pid_index.size ? pid_index.size * 2 : JOBCHUNK;
+    process_t** buckets = calloc (size, sizeof *buckets);
+
+    if (buckets == NULL)
+        return -1;
+
+    /* Rehash live processes */
+    for (int i = 0; i < job_slots; ++i)
+        if (job_hot.pid[i] != 0)
+            for (int j = 0; j < job_list[i]->nprocs; ++j)
+            {
+                process_t* proc = &job_list[i]->procs[j];
+                size_t b        = pid_bucket (proc->pid, size);
+
+                proc->next_pid = buckets[b];
+                buckets[b]     = proc;
+            }
+
+    free (pid_index.buckets);
+    pid_index.buckets = buckets;
+    pid_index.size    = size;
+
+    return 0;
+}
+
+/* Double the number of buckets of the name index */
+static int
+grow_name_index (void)
+{
+    size_t size     = name_index.size ? name_index.size * 2 : JOBCHUNK;
+    job_t** buckets = calloc (size, sizeof *buckets);
+
+    if (buckets == NULL)
+        return -1;
+
+    /* Rehash live jobs */
+    for (int i = 0; i < job_slots; ++i)
+    {
+        job_t* job = job_list[i];
+        size_t b;
+
+        if (job_hot.pid[i] == 0)
+            continue;
+
+        b              = name_bucket (job->name, size);
+        job->next_name = buckets[b];
+        buckets[b]     = job;
+    }
+
+    free (name_index.buckets);
+    name_index.buckets = buckets;
+    name_index.size    = size;
+
+    return 0;
+}
+
+/* Grow an array of job_hot from job_slots to slots entries, zeroed */
+static int
+grow_field (void** field, size_t size, int slots)
+{
+    char* f = realloc (*field, slots * size);
+
+    if (f == NULL)
+        return -1;
+    memset (f + job_slots * size, 0, (slots - job_slots) * size);
+    *field = f;
+    return 0;
+}
+
+/* Double the number of job slots */
+static int
+grow_jobs (void)
+{
+    int slots = job_slots ? job_slots * 2 : JOBCHUNK;
+    int n     = slots - job_slots;
+
+    job_t** list = realloc (job_list, slots * sizeof *list);
+    if (list == NULL)
+        return -1;
+    job_list = list;
+
+    /* Larger arrays are harmless if a later one fails */
+    if ((list = realloc (job_order, slots * sizeof *list)) == NULL)
+        return -1;
+    job_order = list;
+    if (GROW_FIELD (job_hot.pid, slots) < 0
+        || GROW_FIELD (job_hot.pgid, slots) < 0
+        || GROW_FIELD (job_hot.state, slots) < 0
+        || GROW_FIELD (job_hot.status, slots) < 0)
+        return -1;
+
+    job_t* chunk = calloc (n, sizeof *chunk);
+    if (chunk == NULL)
+        return -1;
+
+    /* Pushed backward, the lowest jid is used first */
+    for (int i = n - 1; i >= 0; --i)
+    {
+        chunk[i].jid       = job_slots + i;
+        chunk[i].next_free = free_jobs;
+        free_jobs          = &chunk[i];
+
+        job_list[job_slots + i] = &chunk[i];
+    }
+    job_slots = slots;
+
+    return 0;
+}
+
+/* Register a new job */
+static job_t*
+register_job (const pid_t* pids,
+              int n,
+              pid_t pgid,
+              int background,
+              const char* name,
+              const char* line)
+{
+    job_t* job;
+    process_t* procs;
+    int name_id, line_id;
+    size_t b;
+    int at;
+
+    assert (n > 0);
+
+    /* Make room if needed */
+    if (!free_jobs && grow_jobs () < 0)
+        return NULL;
+    while ((size_t) (proc_count + n) > pid_index.size)
+        if (grow_pid_index () < 0)
+            return NULL;
+    if ((size_t) job_count >= name_index.size && grow_name_index () < 0)
+        return NULL;
+
+    /* Names and command lines are shared by jobs, only kept once */
+    if ((name_id = pool_intern (name)) < 0)
+        return NULL;
+    if ((line_id = pool_intern (line)) < 0)
+    {
+        pool_release (name_id);
+        return NULL;
+    }
+
+    /* Only pipelines need more than the inline process */
+    procs = &free_jobs->proc;
+    if (n > 1 && (procs = calloc (n, sizeof *procs)) == NULL)
+    {
+        pool_release (name_id);
+        pool_release (line_id);
+        return NULL;
+    }
+
+    /* Take a free slot */
+    job       = free_jobs;
+    free_jobs = job->next_free;
+
+    JOB_PID (job)    = pids[0];
+    JOB_PGID (job)   = pgid;
+    JOB_STATE (job)  = JRUNNING;
+    JOB_STATUS (job) = 0;
+    job->background  = background;
+    job->name        = name_id;
+    job->line        = line_id;
+    job->procs       = procs;
+    job->nprocs      = n;
+
+    /* Nothing used yet */
+    clock_gettime (CLOCK_MONOTONIC, &job->start);
+    memset (&job->usage, 0, sizeof job->usage);
+
+    job->place[0] = '\0';
+    if (placement_cur)
+        placement_describe (placement_cur, job->place, PLACEBUFSZ);
+
+    job->report  = -1;
+    job->timeout = TNONE;
+    if (deadline_cur)
+    {
+        job->timeout  = TARMED;
+        job->deadline = *deadline_cur;
+        ++deadline_jobs;
+    }
+
+    /* Index its processes */
+    for (int i = 0; i < n; ++i)
+    {
+        procs[i].pid     = pids[i];
+        procs[i].state   = JRUNNING;
+        procs[i].status  = 0;
+        procs[i].termsig = 0;
+        procs[i].pidfd   = open_pidfd (pids[i]);
+        procs[i].job     = job;
+
+        b                    = pid_bucket (pids[i], pid_index.size);
+        procs[i].next_pid    = pid_index.buckets[b];
+        pid_index.buckets[b] = &procs[i];
+    }
+    proc_count += n;
+
+    /* Index its name */
+    b                     = name_bucket (job->name, name_index.size);
+    job->next_name        = name_index.buckets[b];
+    name_index.buckets[b] = job;
+
+    /* And its command line */
+    at = order_search (pool_string (job->line), job->jid);
+    memmove (job_order + at + 1,
+             job_order + at,
+             (job_count - at) * sizeof *job_order);
+    job_order[at] = job;
+
+    ++job_count;
+
+    return job;
+}
+
+/* Launch a job  */
+static void
+launch_job (job_t* job, int notify)
+{
+    assert (job);
+
+    /* Always start in stopped mode */
+    JOB_STATE (job) = JSTOPPED;
+
+    /* Assign its own group, in a subshell it stays in ours */
+    if (!subshell)
+        setpgid (JOB_PID (job), JOB_PGID (job));
+
+    if (job->background == JFG)
+        send_to_foreground (job);
+    else
+    {
+        send_to_background (job);
+        if (notify)
+            fprintf (stdout, "[%d] %d\n", job->jid, JOB_PID (job));
+    }
+}
+
+/* Unregister job */
+static void
+unregister_job (job_t* job)
+{
+    assert (job);
+
+    job_t** p;
+    int at;
+
+    /* Free slots are not indexed */
+    if (JOB_PID (job) == 0)
+        return;
+
+    /* Unlink its processes */
+    for (int i = 0; i < job->nprocs; ++i)
+    {
+        process_t* proc = &job->procs[i];
+        process_t** pp
+            = &pid_index.buckets[pid_bucket (proc->pid, pid_index.size)];
+
+        while (*pp != proc)
+            pp = &(*pp)->next_pid;
+        *pp = proc->next_pid;
+
+        if (proc->pidfd >= 0)
+            close (proc->pidfd);
+    }
+    proc_count -= job->nprocs;
+    if (job->timeout != TNONE)
+        --deadline_jobs;
+
+    if (job->procs != &job->proc)
+        free (job->procs);
+    job->procs  = NULL;
+    job->nprocs = 0;
+
+    /* Unlink its name */
+    p = &name_index.buckets[name_bucket (job->name, name_index.size)];
+    while (*p != job)
+        p = &(*p)->next_name;
+    *p = job->next_name;
+
+    /* And its command line, the key is unique */
+    at = order_search (pool_string (job->line), job->jid);
+    memmove (job_order + at,
+             job_order + at + 1,
+             (job_count - at - 1) * sizeof *job_order);
+
+    pool_release (job->name);
+    pool_release (job->line);
+
+    /* Give back the slot */
+    job->next_free = free_jobs;
+    free_jobs      = job;
+    --job_count;
+
+    if (last_job == job)
+        last_job = NULL;
+
+    JOB_PID (job)    = 0;
+    JOB_STATUS (job) = 0;
+    job->termsig     = 0;
+}
+
+/* Remove old jobs */
+static void
+remove_old_jobs (int notify)
+{
+    for (int i = 0; i < job_slots && job_count; ++i)
+        if (job_hot.pid[i] != 0 && job_hot.state[i] == JDONE)
+        {
+            /* We do not want to notify for foreground jobs */
+            if (notify && job_list[i]->background == JBG)
+                display_job (job_list[i]);
+            show_report (job_list[i]);
+            unregister_job (job_list[i]);
+        }
+}
+
+/* Find a process from a pid */
+static process_t*
+find_proc (pid_t pid)
+{
+    process_t* proc;
+
+    if (!pid_index.size)
+        return NULL;
+
+    proc = pid_index.buckets[pid_bucket (pid, pid_index.size)];
+    while (proc && proc->pid != pid)
+        proc = proc->next_pid;
+
+    return proc;
+}
+
+/* Find a job from its name */
+static job_t*
+find_job_name (const char* cmd)
+{
+    int name = pool_find (cmd);
+    job_t* job;
+
+    /* Not the name of any job */
+    if (name < 0 || !name_index.size)
+        return NULL;
+
+    job = name_index.buckets[name_bucket (name, name_index.size)];
+    while (job && job->name != name)
+        job = job->next_name;
+
+    return job;
+}
+
+/* Suspend a job using TSTP */
+static void
+suspend_job (job_t* job)
+{
+    assert (job);
+
+    /* Send Terminal Stop to the whole job */
+    if (kill (-JOB_PGID (job), SIGTSTP) < 0)
+        perror ("Unable to send TSTP");
+
+    JOB_STATE (job) = JSTOPPED;
+    job->background = JBG;
+
+    last_job = job;
+}
+
+/* Resume a stopped job */
+static void
+continue_job (job_t* job)
+{
+    assert (job);
+
+    if (kill (-JOB_PGID (job), SIGCONT) < 0)
+        fprintf (stderr,
+                 "Unable to send continue to job %d: %s\n",
+                 job->jid,
+                 strerror (errno));
+
+    for (int i = 0; i < job->nprocs; ++i)
+        if (job->procs[i].state == JSTOPPED)
+            job->procs[i].state = JRUNNING;
+    JOB_STATE (job) = JRUNNING;
+}
+
+/* Send a job to foreground */
+static void
+send_to_foreground (job_t* job)
+{
+    assert (job);
+
+    /* Set default handler to all signals */
+    /* This is to prevent re-entering and f'ing up some apps */
+    /* A subshell already has them, and its own stops are handled by its
+     * parent: it only waits for termination */
+    if (!subshell)
+    {
+        register_signals (&sigdfl);
+        /* SIGCHLD only notifies the self-pipe, background jobs may end
+         * meanwhile */
+        sigaction (SIGCHLD, &sigact, NULL);
+    }
+
+    /* Give the terminal back to the job */
+    if (interactive)
+        tcsetpgrp (0, JOB_PGID (job));
+
+    /* Set current foreground job */
+    fg_job          = job;
+    job->background = JFG;
+
+    /* Send SIGCONT if in stopped state */
+    if (JOB_STATE (job) == JSTOPPED)
+        continue_job (job);
+
+    /* A script parses its next lines while the job runs */
+    AnalyserAvance ();
+
+    /* Wait for every process of the job to finish or the job to be stopped
+     * by user, or its deadline */
+    while (JOB_STATE (job) == JRUNNING)
+        wait_children (&job, 1, subshell ? WHANG : WUNTRACED);
+
+    /* Re-register signal */
+    if (!subshell)
+        register_signals (&sigact);
+
+    /* Give back terminal to shell */
+    if (interactive)
+        tcsetpgrp (0, shpid);
+}
+
+/* pidfd of a process */
+static int
+open_pidfd (pid_t pid)
+{
+#ifdef __linux__
+    /* Already close on exec */
+    return syscall (SYS_pidfd_open, pid, 0);
+#else
+    (void) pid;
+    return -1;
+#endif
+}
+
+/* Send a signal to a job: its group, or in a subshell which shares its
+ * group with its jobs, each of its processes */
+static void
+signal_job (job_t* job, int signo)
+{
+    if (!subshell)
+    {
+        kill (-JOB_PGID (job), signo);
+        return;
+    }
+
+    for (int i = 0; i < job->nprocs; ++i)
+    {
+        process_t* proc = &job->procs[i];
+
+        if (proc->state == JDONE)
+            continue;
+#ifdef __linux__
+        /* The pid cannot have been reused */
+        if (proc->pidfd >= 0
+            && syscall (SYS_pidfd_send_signal, proc->pidfd, signo, NULL, 0)
+                   == 0)
+            continue;
+#endif
+        kill (proc->pid, signo);
+    }
+}
+
+/* Signal jobs past their deadline */
+static int
+check_deadlines (void)
+{
+    struct timespec now;
+    long next = -1;
+
+    if (!deadline_jobs)
+        return -1;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    for (int i = 0; i < job_slots; ++i)
+    {
+        job_t* job;
+        long ms;
+
+        if (job_hot.pid[i] == 0 || job_hot.state[i] == JDONE)
+            continue;
+        job = job_list[i];
+        if (job->timeout == TNONE || job->timeout == TKILL)
+            continue;
+
+        /* Rounded up, poll must not wake up just before */
+        ms = (job->deadline.tv_sec - now.tv_sec) * 1000
+             + (job->deadline.tv_nsec - now.tv_nsec + 999999) / 1000000;
+        if (ms <= 0)
+        {
+            /* SIGTERM, or SIGKILL if it was not enough */
+            if (job->timeout == TARMED)
+            {
+                signal_job (job, SIGTERM);
+                if (JOB_STATE (job) == JSTOPPED)
+                    continue_job (job);
+                job->timeout         = TTERM;
+                job->deadline        = now;
+                job->deadline.tv_sec = now.tv_sec + TIMEOUT_GRACE;
+                ms                   = TIMEOUT_GRACE * 1000;
+            }
+            else
+            {
+                signal_job (job, SIGKILL);
+                job->timeout = TKILL;
+                continue;
+            }
+        }
+
+        if (next < 0 || ms < next)
+            next = ms;
+    }
+
+    return next > INT_MAX ? INT_MAX : next;
+}
+
+/* Wait until a child changes state, or the next deadline */
+static void
+wait_children (job_t* const* jobs, int n, int flags)
+{
+    struct pollfd fds[WAIT_FDS + 1];
+    char buf[64];
+    int nfds  = 0;
+    int blind = 0;
+    int timeout;
+
+    /* SIGCHLD tells about stops, pidfds about exits even without it */
+    fds[nfds++] = (struct pollfd){sigchld_pipe[0], POLLIN, 0};
+    for (int j = 0; j < n; ++j)
+        for (int i = 0; i < jobs[j]->nprocs; ++i)
+        {
+            const process_t* proc = &jobs[j]->procs[i];
+
+            if (proc->state != JRUNNING)
+                continue;
+            if (proc->pidfd >= 0 && nfds <= WAIT_FDS)
+                fds[nfds++] = (struct pollfd){proc->pidfd, POLLIN, 0};
+            else
+                blind = 1;
+        }
+
+    /* A subshell has no SIGCHLD handler, without pidfd look now and then */
+    timeout = check_deadlines ();
+    if (blind && subshell && (timeout < 0 || timeout > WAIT_BLIND_MS))
+        timeout = WAIT_BLIND_MS;
+
+    if (poll (fds, nfds, timeout) < 0 && errno != EINTR)
+        perror ("Wait for children");
+
+    while (read (sigchld_pipe[0], buf, sizeof buf) > 0)
+        ;
+    reap_children (flags);
+    check_deadlines ();
+}
+
+/* Send a job to background (and resume it) */
+static void
+send_to_background (job_t* job)
+{
+    assert (job);
+
+    /* Send SIGCONT if in stopped state */
+    if (JOB_STATE (job) == JSTOPPED)
+        continue_job (job);
+
+    job->background = JBG;
+    last_job        = job;
+}
+
+/* Display a job */
+static void
+display_job (const job_t* job)
+{
+    assert (job);
+
+    char* strstate = "Running";
+    if (JOB_STATE (job) == JDONE)
+        strstate = "Done";
+    else if (JOB_STATE (job) == JSTOPPED)
+        strstate = "Suspended";
+
+    fprintf (stdout,
+             "[%d]+ %s\t%s\tPID: %d",
+             job->jid,
+             strstate,
+             pool_string (job->line),
+             JOB_PID (job));
+    if (JOB_STATE (job) == JDONE)
+        if (job->termsig)
+            fprintf (stdout, "\tTerminated with signal %d\n", job->termsig);
+        else
+            fprintf (stdout, "\tExit %d\n", JOB_STATUS (job));
+    else
+        fprintf (stdout, "\n");
+}
+
+/* Seconds as a double */
+static inline double
+seconds (const struct timeval* tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/* Seconds between two timespec */
+static inline double
+elapsed (const struct timespec* from, const struct timespec* to)
+{
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/* Display times of a job, only processes done are accounted */
+static void
+display_usage (const job_t* job)
+{
+    struct timespec now = job->end;
+
+    if (JOB_STATE (job) != JDONE)
+        clock_gettime (CLOCK_MONOTONIC, &now);
+
+    fprintf (stdout,
+             "\telapsed %.3fs\tuser %.3fs\tsys %.3fs\tmaxrss %ldKB\n",
+             elapsed (&job->start, &now),
+             seconds (&job->usage.ru_utime),
+             seconds (&job->usage.ru_stime),
+             job->usage.ru_maxrss);
+}
+
+/* Add the usage of processes */
+static void
+add_usage (struct rusage* to, const struct rusage* ru)
+{
+    to->ru_utime.tv_sec += ru->ru_utime.tv_sec;
+    to->ru_utime.tv_usec += ru->ru_utime.tv_usec;
+    to->ru_stime.tv_sec += ru->ru_stime.tv_sec;
+    to->ru_stime.tv_usec += ru->ru_stime.tv_usec;
+
+    /* Keep microseconds under a second */
+    to->ru_utime.tv_sec += to->ru_utime.tv_usec / 1000000;
+    to->ru_utime.tv_usec %= 1000000;
+    to->ru_stime.tv_sec += to->ru_stime.tv_usec / 1000000;
+    to->ru_stime.tv_usec %= 1000000;
+
+    if (ru->ru_maxrss > to->ru_maxrss)
+        to->ru_maxrss = ru->ru_maxrss;
+}
+
+/*******************
+ * Signal Handling *
+ *******************/
+
+/* Create the self-pipe, both ends non blocking */
+static int
+init_reaper (void)
+{
+    /* A forked shell must not share its parent's pipe */
+    if (sigchld_pipe[0] != -1)
+    {
+        close (sigchld_pipe[0]);
+        close (sigchld_pipe[1]);
+    }
+
+    if (pipe2 (sigchld_pipe, O_CLOEXEC) < 0)
+        goto err;
+    if (fcntl (sigchld_pipe[0], F_SETFL, O_NONBLOCK) < 0
+        || fcntl (sigchld_pipe[1], F_SETFL, O_NONBLOCK) < 0)
+        goto err;
+
+    return 0;
+
+err:
+    perror ("Unable to create SIGCHLD pipe");
+    return -1;
+}
+
+/* Register signals used by the program */
+static void
+register_signals (struct sigaction* sig)
+{
+    assert (sig);
+
+    /* All signals are in a list terminated by -1 */
+    for (int* s = sigregistered; *s != -1; s++)
+        if (sigaction (*s, sig, NULL) != 0)
+            goto err;
+
+    return;
+
+err:
+    perror ("Unable to register signals");
+}
+
+/* Signal handler */
+static void
+sig_handler (int signo)
+{
+    int saved_errno = errno;
+
+    switch (signo)
+    {
+        /* Wake up the reaper, if the pipe is full it is already awake */
+        case SIGCHLD:
+            write (sigchld_pipe[1], "", 1);
+            break;
+
+        /* Send INT to foreground job */
+        case SIGINT:
+            sigint_flag = 1;
+            if (!fg_job)
+                break;
+            if (kill (-JOB_PGID (fg_job), SIGINT) < 0)
+                perror ("Unable to send SIGINT to foreground process");
+            break;
+
+        /* Suspend current foreground job */
+        case SIGTSTP:
+            if (fg_job)
+                suspend_job (fg_job);
+            break;
+
+        /* Get back control of the terminal */
+        // TODO: Sequence with stdout being suspended
+        case SIGTTIN:
+        case SIGTTOU:
+            tcsetpgrp (0, shpid);
+            break;
+    }
+
+    errno = saved_errno;
+}
+
+/* Change status of a process, then of its job */
+static void
+set_status_proc (process_t* proc, int wstatus, const struct rusage* ru)
+{
+    assert (proc);
+
+    job_t* job  = proc->job;
+    int running = 0;
+    int stopped = 0;
+
+    /* A stopped process gives its usage so far, only count it once done */
+    if (ru && (WIFEXITED (wstatus) || WIFSIGNALED (wstatus)))
+    {
+        add_usage (&job->usage, ru);
+        if (timed_usage)
+            add_usage (timed_usage, ru);
+    }
+
+    if (WIFEXITED (wstatus) || WIFSIGNALED (wstatus))
+    {
+        if (proc->pidfd >= 0)
+            close (proc->pidfd);
+        proc->pidfd = -1;
+    }
+
+    if (WIFEXITED (wstatus))
+    {
+        proc->status = WEXITSTATUS (wstatus);
+        proc->state  = JDONE;
+    }
+    else if (WIFSTOPPED (wstatus))
+        proc->state = JSTOPPED;
+    else if (WIFSIGNALED (wstatus))
+    {
+        proc->state   = JDONE;
+        proc->termsig = WTERMSIG (wstatus);
+        proc->status  = 128 + proc->termsig;
+    }
+    else if (WIFCONTINUED (wstatus))
+        proc->state = JRUNNING;
+
+    for (int i = 0; i < job->nprocs; ++i)
+        if (job->procs[i].state == JRUNNING)
+            ++running;
+        else if (job->procs[i].state == JSTOPPED)
+            ++stopped;
+
+    /* Still running, or stopped once nothing runs anymore */
+    if (running)
+        JOB_STATE (job) = JRUNNING;
+    else if (stopped)
+    {
+        JOB_STATE (job)  = JSTOPPED;
+        JOB_STATUS (job) = 0;
+    }
+    else
+    {
+        /* Status of the last process, or with pipefail the last one
+         * that failed */
+        proc = &job->procs[job->nprocs - 1];
+        if (shopt.pipefail)
+            for (int i = job->nprocs - 1; i >= 0; --i)
+                if (job->procs[i].status)
+                {
+                    proc = &job->procs[i];
+                    break;
+                }
+
+        if (JOB_STATE (job) != JDONE)
+            clock_gettime (CLOCK_MONOTONIC, &job->end);
+
+        JOB_STATE (job)  = JDONE;
+        JOB_STATUS (job) = proc->status;
+        job->termsig     = proc->termsig;
+
+        /* Killed by "timeout", which is not a crash */
+        if (job->timeout > TARMED)
+        {
+            JOB_STATUS (job) = TIMEOUT_STATUS;
+            job->termsig     = 0;
+        }
+    }
+}
+
+/* Reap zombie processes, never called from a signal handler */
+static void
+grim_reaper (void)
+{
+    char buf[64];
+    int woken = 0;
+
+    /* Drain the self-pipe */
+    while (read (sigchld_pipe[0], buf, sizeof buf) > 0)
+        woken = 1;
+
+    /* Jobs in background may be past their deadline */
+    check_deadlines ();
+
+    /* No SIGCHLD since last time */
+    if (!woken)
+        return;
+    reap_children (WUNTRACED | WCONTINUED);
+}
+
+/* Reap children that changed state */
+static void
+reap_children (int flags)
+{
+    int wstatus;
+    struct rusage ru;
+    pid_t pid;
+    process_t* proc;
+
+    /* One call per child that changed state, any process, which may belong
+     * to another job */
+    while ((pid = wait4 (-1, &wstatus, flags | WNOHANG, &ru)) > 0)
+        if ((proc = find_proc (pid)))
+            set_status_proc (proc, wstatus, &ru);
+}
+
+/***********************
+ * Prepare for command *
+ ***********************/
+
+/* Maximum size of a pipe, 0 if unknown */
+static int
+pipe_max_size (void)
+{
+    static int max = -1;
+    FILE* f;
+
+    /* Read it only once */
+    if (max >= 0)
+        return max;
+
+    max = 0;
+    if ((f = fopen (PIPEBUF_MAX, "r")))
+    {
+        if (fscanf (f, "%d", &max) != 1)
+            max = 0;
+        fclose (f);
+    }
+
+    return max;
+}
+
+/* Create a pipe, its buffer is grown to size if not 0 */
+static int
+make_pipe (int pipefd[2], int size)
+{
+    /* O_CLOEXEC closes the pipe's file descriptors on exec
+     This prevents the pipe from being opened and having a background process
+     never ending */
+    if (pipe2 (pipefd, O_CLOEXEC) == -1)
+        return -1;
+
+#ifdef F_SETPIPE_SZ
+    if (size > 0)
+    {
+        int max = pipe_max_size ();
+        if (max > 0 && size > max)
+            size = max;
+
+        /* Not fatal, the pipe works with its default size */
+        fcntl (pipefd[1], F_SETPIPE_SZ, size);
+    }
+#endif
+
+    return 0;
+}
+
+/* Create n pipes */
+static int
+make_pipes (int (*pipes)[2], int n, int size)
+{
+    for (int i = 0; i < n; ++i)
+        if (make_pipe (pipes[i], size) == -1)
+        {
+            perror ("Unable to set pipe");
+            close_pipes (pipes, i);
+            return -1;
+        }
+    return 0;
+}
+
+/* Close n pipes */
+static void
+close_pipes (int (*pipes)[2], int n)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        close (pipes[i][0]);
+        close (pipes[i][1]);
+    }
+}
+
+/* Count the stages of a pipeline */
+static int
+count_stages (const Expression* e)
+{
+    if (e->type != PIPE)
+        return 1;
+    return count_stages (e->gauche) + count_stages (e->droite);
+}
+
+/* Flatten a pipeline from left to right, returns the next free stage */
+static stage_t*
+flatten_pipeline (const Expression* e, stage_t* stages)
+{
+    if (e->type != PIPE)
+    {
+        /* Only a simple command has arguments, a subshell has none */
+        stages->e    = e;
+        stages->argv = e->type == SIMPLE ? expand_arguments (e->arguments)
+                                         : e->arguments;
+        return stages + 1;
+    }
+    stages = flatten_pipeline (e->gauche, stages);
+    return flatten_pipeline (e->droite, stages);
+}
+
+/* Run an internal command in the shell, its output is kept in the arena */
+/* Returns its status, or -1 if it must run in a child */
+static int
+capture_internal (char** argv, char** out, size_t* len)
+{
+    int saved, wstatus;
+    off_t size;
+
+    /* One unlinked file, reused */
+    if (capture_fd < 0)
+    {
+        FILE* f = tmpfile ();
+        if (!f)
+            return -1;
+        capture_fd = fcntl (fileno (f), F_DUPFD_CLOEXEC, 10);
+        fclose (f);
+        if (capture_fd < 0)
+            return -1;
+    }
+
+    if (ftruncate (capture_fd, 0) < 0 || lseek (capture_fd, 0, SEEK_SET) < 0)
+        return -1;
+
+    fflush (stdout);
+    if ((saved = fcntl (STDOUT_FILENO, F_DUPFD_CLOEXEC, 10)) < 0)
+        return -1;
+    if (dup2 (capture_fd, STDOUT_FILENO) < 0)
+    {
+        close (saved);
+        return -1;
+    }
+
+    wstatus = internal_cmd (*argv, argv);
+
+    fflush (stdout);
+    dup2 (saved, STDOUT_FILENO);
+    close (saved);
+
+    /* Read it back */
+    if ((size = lseek (capture_fd, 0, SEEK_CUR)) < 0)
+        return -1;
+    *out = arena_alloc (ArenaCourante, size + 1);
+    if (pread (capture_fd, *out, size, 0) != size)
+        return -1;
+    *len = size;
+
+    STATUS (wstatus);
+    return wstatus;
+}
+
+/* Write without blocking, returns the number of bytes written */
+static size_t
+write_some (int fd, const char* buf, size_t len)
+{
+    int flags = fcntl (fd, F_GETFL);
+    size_t done = 0;
+    ssize_t n;
+
+    if (flags < 0 || fcntl (fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        return 0;
+
+    while (done < len)
+    {
+        if ((n = write (fd, buf + done, len - done)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        done += n;
+    }
+
+    fcntl (fd, F_SETFL, flags);
+    return done;
+}
+
+/* Run a pipeline stage in a forked child, never returns */
+static void
+run_stage (const stage_t* stage)
+{
+    const Expression* e = stage->e;
+    char** argv         = stage->argv;
+    redir_plan_t plan;
+    int nassign;
+    int wstatus;
+
+    /* The pipeline is the job, nothing is done with the terminal here */
+    subshell    = 1;
+    interactive = 0;
+
+    /* Already in the child, redirect a command before executing it */
+    if (e->type >= REDIRECTION_I)
+    {
+        compile_redirections (e, &plan);
+        if (plan.cmd->type == SIMPLE)
+        {
+            if (apply_plan (&plan) < 0)
+                exit (1);
+            e    = plan.cmd;
+            argv = expand_arguments (e->arguments);
+        }
+        /* Otherwise redirected as a whole, its here-documents made again */
+        release_plan (&plan);
+    }
+
+    /* Simple commands are executed in place */
+    if (e->type == SIMPLE)
+    {
+        /* Assignments before the command are for it only, as this child */
+        for (nassign = 0; argv[nassign] && is_assignment (argv[nassign]);
+             ++nassign)
+            ;
+        if (assign_variables (argv, nassign, 1) < 0)
+            exit (1);
+        if (!*(argv += nassign))
+            exit (0);
+        env_envp ();
+
+        if ((wstatus = internal_cmd (*argv, argv)) == -1)
+            exec_cmd (hash_lookup (*argv), *argv, argv);
+    }
+    else
+    {
+        /* Its children must not wake up the parent's reaper */
+        init_reaper ();
+        tail_exec = 1;
+        wstatus   = expression_handler (e, JFG, 0);
+    }
+
+    STATUS (wstatus);
+    exit (wstatus);
+}
+
+/* Launch all stages of a pipeline in one process group */
+static int
+lay_pipeline (const Expression* e, int options, int notify)
+{
+    int n           = count_stages (e);
+    stage_t* stages = arena_alloc (ArenaCourante, n * sizeof *stages);
+    int (*pipes)[2] = arena_alloc (ArenaCourante, n * sizeof *pipes);
+    pid_t* pids     = arena_alloc (ArenaCourante, (n + 1) * sizeof *pids);
+    pid_t pgid      = 0;
+    int started     = 0;
+    int skipped     = 0;
+    int pipebuf     = shopt.pipebuf;
+    int wstatus     = -1;
+    int monitor     = 0;
+    int report[2]   = {-1, -1};
+    int (*relays)[2] = pipes;
+    const placement_t* saved_placement = placement_cur;
+    const placement_t* placed          = placement_cur;
+    const struct timespec* saved_deadline = deadline_cur;
+    const struct timespec* timed          = deadline_cur;
+    struct timespec deadline;
+    placement_t prefix;
+    const builtin_t* builtin;
+    const Expression* first;
+    char** argv;
+    char* out;
+    size_t len, written = 0;
+    job_t* job;
+
+    flatten_pipeline (e, stages);
+
+    /* "pipebuf size" before the first command overrides "set pipebuf" */
+    argv = stages[0].argv;
+    if (stages[0].e->type == SIMPLE && strcmp (argv[0], "pipebuf") == 0
+        && argv[1] && argv[2])
+    {
+        if (parse_size (argv[1], &pipebuf) < 0)
+        {
+            fprintf (stderr, "pipebuf: invalid size: %s\n", argv[1]);
+            return INTERNSTATUS + 1;
+        }
+        stages[0].argv += 2;
+    }
+
+    /* "on key=value ..." before the first command places every stage */
+    argv = stages[0].argv;
+    if (stages[0].e->type == SIMPLE && strcmp (argv[0], "on") == 0)
+    {
+        placement_t given = {0};
+        int i;
+
+        if ((i = parse_placement (argv, &given)) < 0)
+            return INTERNSTATUS + 1;
+        if (!argv[i])
+        {
+            fprintf (stderr, "on: no command\n");
+            return INTERNSTATUS + 1;
+        }
+        prefix = placed ? *placed : (placement_t){0};
+        placement_merge (&prefix, &given);
+        stages[0].argv += i;
+        placed = &prefix;
+    }
+
+    /* A stage cannot be placed apart from its pipeline */
+    for (int i = 1; i < n; ++i)
+        if (stages[i].e->type == SIMPLE
+            && strcmp (stages[i].argv[0], "on") == 0)
+        {
+            fprintf (stderr, "on: only valid at the start of a pipeline\n");
+            return INTERNSTATUS + 1;
+        }
+
+    /* "timeout secs" before the first command gives the job a deadline */
+    argv = stages[0].argv;
+    if (stages[0].e->type == SIMPLE && strcmp (argv[0], "timeout") == 0)
+    {
+        if (!argv[1] || !argv[2] || parse_deadline (argv[1], &deadline) < 0)
+        {
+            fprintf (stderr, "timeout: usage: timeout secs[smhd] cmd\n");
+            return INTERNSTATUS + 1;
+        }
+        stages[0].argv += 2;
+        timed = &deadline;
+    }
+
+    /* With pipestats each stage writes to the monitor, which relays to the
+     * next one through a second pipe, splice is Linux only */
+#ifdef __linux__
+    if (shopt.pipestats)
+        relays = arena_alloc (ArenaCourante, n * sizeof *relays);
+#endif
+
+    /* Create all pipes up front */
+    if (make_pipes (pipes, n - 1, pipebuf) == -1)
+        return INTERNSTATUS + 1;
+    if (relays != pipes && make_pipes (relays, n - 1, pipebuf) == -1)
+    {
+        close_pipes (pipes, n - 1);
+        return INTERNSTATUS + 1;
+    }
+
+    /* Children must not inherit pending output */
+    fflush (stdout);
+
+    /* The monitor leads the group, it is the first process of the job so
+     * that its status is the one of the last stage */
+    if (relays != pipes)
+    {
+        pid_t pid = -1;
+
+        if (pipe2 (report, O_CLOEXEC) < 0 || (pid = fork ()) < 0)
+        {
+            perror ("Unable to start pipe monitor");
+            if (report[0] >= 0)
+            {
+                close (report[0]);
+                close (report[1]);
+            }
+            close_pipes (pipes, n - 1);
+            close_pipes (relays, n - 1);
+            return INTERNSTATUS + 1;
+        }
+        if (!pid)
+        {
+            if (!subshell)
+            {
+                register_signals (&sigdfl);
+                if (setpgid (0, 0) < 0)
+                    perror ("Unable to set pipeline group");
+            }
+            close (report[0]);
+            run_pipestats (stages, n, pipes, relays, report[1]);
+        }
+
+        close (report[1]);
+        pgid    = subshell ? getpgrp () : pid;
+        pids[0] = pid;
+        monitor = 1;
+        if (!subshell)
+            setpgid (pid, pgid);
+    }
+
+    /* An internal command printing something short is run in the shell, its
+     * output goes to the pipe without blocking, so a reader which does not
+     * keep up never stops us. What is left is written by a child, which
+     * also gives a failure to pipefail. */
+    argv = stages[0].argv;
+    if (stages[0].e->type == SIMPLE && (builtin = find_builtin (*argv))
+        && (builtin->flags & BUILTIN_PIPE)
+        && (wstatus = capture_internal (argv, &out, &len)) >= 0)
+    {
+        written = write_some (pipes[0][1], out, len);
+        skipped = written == len && wstatus == 0;
+    }
+
+    for (started = skipped; started < n; ++started)
+    {
+        pid_t pid = fork ();
+        if (pid < 0)
+        {
+            perror ("Unable to fork");
+            break;
+        }
+
+        if (!pid)
+        {
+            if (!subshell)
+                register_signals (&sigdfl);
+
+            /* Same group for all stages, the first one leads it */
+            if (!subshell && setpgid (0, pgid) < 0)
+                perror ("Unable to set pipeline group");
+
+            /* Inherited by everything the stage starts */
+            if (placed && placement_apply (placed) < 0)
+                exit (1);
+            placement_cur = NULL;
+
+            /* Wire only in the child, the monitor may be in between */
+            if (started > 0
+                && dup2 (relays[started - 1][0], STDIN_FILENO) < 0)
+                goto err;
+            if (started < n - 1 && dup2 (pipes[started][1], STDOUT_FILENO) < 0)
+                goto err;
+            close_pipes (pipes, n - 1);
+            if (relays != pipes)
+                close_pipes (relays, n - 1);
+
+            /* Rest of the output of an internal command already run */
+            if (started == 0 && wstatus >= 0)
+            {
+                while (written < len)
+                {
+                    ssize_t w = write (STDOUT_FILENO, out + written,
+                                       len - written);
+                    if (w < 0 && errno == EINTR)
+                        continue;
+                    if (w < 0)
+                        exit (1);
+                    written += w;
+                }
+                exit (wstatus);
+            }
+
+            run_stage (&stages[started]);
+
+        err:
+            perror ("Unable to set pipe");
+            exit (1);
+        }
+
+        /* Also done by the parent, whichever runs first */
+        if (!pgid)
+            pgid = subshell ? getpgrp () : pid;
+        if (!subshell)
+            setpgid (pid, pgid);
+        pids[monitor + started - skipped] = pid;
+    }
+
+    /* Only children use the pipes */
+    close_pipes (pipes, n - 1);
+    if (relays != pipes)
+        close_pipes (relays, n - 1);
+
+    /* The monitor ends by itself once its pipes are closed */
+    if (started == skipped)
+    {
+        if (monitor)
+            close (report[0]);
+        return INTERNSTATUS + 1;
+    }
+
+    /* The job is named after its first command */
+    first = stages[0].e;
+    while (first->type >= REDIRECTION_I)
+        first = first->gauche;
+
+    placement_cur = placed;
+    deadline_cur  = timed;
+    job           = register_job (pids,
+                        monitor + started - skipped,
+                        pgid,
+                        options,
+                        first->type != SIMPLE  ? "Pipeline"
+                        : first == stages[0].e ? *stages[0].argv
+                                               : *first->arguments,
+                        job_line (e, NULL));
+    placement_cur = saved_placement;
+    deadline_cur  = saved_deadline;
+    if (!job)
+    {
+        perror ("Unable to register a new job");
+        kill (-pgid, SIGKILL);
+        if (monitor)
+            close (report[0]);
+        return INTERNSTATUS + 1;
+    }
+    job->report = report[0];
+
+    launch_job (job, notify);
+
+    /* If job is in foreground wait and return exit status */
+    if (options == JFG)
+    {
+        if (JOB_STATE (job) == JDONE)
+            show_report (job);
+        return JOB_STATUS (job);
+    }
+    else
+        return INTERNSTATUS;
+}
+
+/* The monitor was part of the job, it is done too */
+static void
+show_report (job_t* job)
+{
+    char buf[PIPE_BUF];
+    ssize_t n;
+
+    if (job->report < 0)
+        return;
+
+    fflush (stdout);
+    while ((n = read (job->report, buf, sizeof buf)) > 0
+           && write (STDERR_FILENO, buf, n) == n)
+        ;
+    close (job->report);
+    job->report = -1;
+}
+
+/* Name of a stage for pipestats */
+static const char*
+stage_name (const stage_t* stage)
+{
+    const Expression* e = stage->e;
+
+    if (e->type == SIMPLE)
+        return *stage->argv;
+    while (e->type >= REDIRECTION_I)
+        e = e->gauche;
+    return e->type == SIMPLE ? *e->arguments : "(...)";
+}
+
+/* Move what is available from a pipe to the next one, 0 once closed */
+static int
+relay_some (relay_t* r)
+{
+#ifdef __linux__
+    ssize_t n;
+    int avail;
+
+    while ((n = syscall (SYS_splice,
+                         r->src,
+                         NULL,
+                         r->dst,
+                         NULL,
+                         RELAY_CHUNK,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK))
+           > 0)
+        r->bytes += n;
+
+    /* End of file, or the stage after is gone */
+    if (n == 0 || errno == EPIPE)
+        return 0;
+    if (errno != EAGAIN && errno != EINTR)
+        return 0;
+
+    /* Nothing to read, or no room in the pipe of the stage after */
+    if (ioctl (r->src, FIONREAD, &avail) == 0 && avail > 0)
+    {
+        r->full = 1;
+        clock_gettime (CLOCK_MONOTONIC, &r->since);
+    }
+#else
+    (void) r;
+#endif
+    return 1;
+}
+
+/* The monitor is a process of the job: it stops with it, but survives
+ * Ctrl-C to report how far the pipeline went */
+static void
+run_pipestats (const stage_t* stages,
+               int n,
+               int (*pipes)[2],
+               int (*relays)[2],
+               int report)
+{
+    relay_t* r         = arena_alloc (ArenaCourante, n * sizeof *r);
+    struct pollfd* fds = arena_alloc (ArenaCourante, n * sizeof *fds);
+    FILE* out          = fdopen (report, "w");
+    struct timespec start, now;
+    int open    = n - 1;
+    int slowest = 0;
+    double total;
+
+    signal (SIGINT, SIG_IGN);
+    signal (SIGPIPE, SIG_IGN);
+    clock_gettime (CLOCK_MONOTONIC, &start);
+
+    /* Only keep the ends of the monitor, the stages do the same */
+    for (int i = 0; i < n - 1; ++i)
+    {
+        close (pipes[i][1]);
+        close (relays[i][0]);
+        r[i] = (relay_t){pipes[i][0], relays[i][1], 0, 0, {0, 0}, 0, 0};
+        fcntl (r[i].src, F_SETFL, O_NONBLOCK);
+        fcntl (r[i].dst, F_SETFL, O_NONBLOCK);
+    }
+
+    while (open)
+    {
+        /* A full pipe waits for room, any other for data */
+        for (int i = 0; i < n - 1; ++i)
+        {
+            fds[i].fd     = r[i].src < 0 ? -1 : r[i].full ? r[i].dst : r[i].src;
+            fds[i].events = r[i].full ? POLLOUT : POLLIN;
+        }
+
+        if (poll (fds, n - 1, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        clock_gettime (CLOCK_MONOTONIC, &now);
+        for (int i = 0; i < n - 1; ++i)
+        {
+            if (r[i].src < 0 || !fds[i].revents)
+                continue;
+
+            if (r[i].full)
+            {
+                r[i].full_time += elapsed (&r[i].since, &now);
+                r[i].full = 0;
+            }
+
+            if (!relay_some (&r[i]))
+            {
+                close (r[i].src);
+                close (r[i].dst);
+                r[i].src = -1;
+                r[i].end = elapsed (&start, &now);
+                --open;
+            }
+        }
+    }
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    total = elapsed (&start, &now);
+
+    /* A stage is the one slowing the pipeline down if its input is full
+     * while its output is not, without any full pipe it is the first one */
+    for (int i = 0; i < n - 1; ++i)
+        if (r[i].end > 0 && r[i].full_time / r[i].end >= RELAY_FULL)
+            slowest = i + 1;
+
+    /* Printed by the shell once every stage is done */
+    if (!out)
+        _exit (1);
+    fprintf (out, "pipestats: %.3fs\n", total);
+    for (int i = 0; i < n - 1; ++i)
+    {
+        double t = r[i].end > 0 ? r[i].end : total;
+        fprintf (out,
+                 "  %s | %s\t%lld bytes\t%.1f MB/s\tfull %.0f%%\n",
+                 stage_name (&stages[i]),
+                 stage_name (&stages[i + 1]),
+                 r[i].bytes,
+                 t > 0 ? r[i].bytes / t / 1e6 : 0,
+                 t > 0 ? 100 * r[i].full_time / t : 0);
+    }
+    fprintf (out, "  slowest: %s\n", stage_name (&stages[slowest]));
+
+    /* exit would flush the stdin of the shell, moving back its offset */
+    fclose (out);
+    _exit (0);
+}
+
+/* Compile the chain, outermost redirection first as it used to be applied */
+static void
+compile_redirections (const Expression* e, redir_plan_t* plan)
+{
+    const Expression* it;
+    redir_t* r;
+    int n = 0;
+
+    /* "&>" needs two entries */
+    for (it = e; it->type >= REDIRECTION_I; it = it->gauche)
+        n += it->type == REDIRECTION_EO ? 2 : 1;
+
+    plan->redirs = r = arena_alloc (ArenaCourante, n * sizeof *r);
+    plan->n          = n;
+    plan->cmd        = it;
+
+    for (it = e; it->type >= REDIRECTION_I; it = it->gauche, ++r)
+    {
+        r->path  = *it->arguments;
+        r->flags = O_OUT;
+        r->fd    = STDOUT_FILENO;
+
+        switch (it->type)
+        {
+            case REDIRECTION_I:
+                r->flags = O_IN;
+                r->fd    = STDIN_FILENO;
+                break;
+
+            case REDIRECTION_A:
+                r->flags = (O_OUT & ~O_TRUNC) | O_APPEND;
+                break;
+
+            case REDIRECTION_E:
+                r->fd = STDERR_FILENO;
+                break;
+
+            case REDIRECTION_EO:
+                /* Then stderr joins stdout */
+                ++r;
+                r->path = NULL;
+                r->fd   = STDERR_FILENO;
+                r->from = STDOUT_FILENO;
+                break;
+
+            case REDIRECTION_HS:
+            case REDIRECTION_HD:
+                /* Read from memory, an empty file if it failed */
+                r->fd = STDIN_FILENO;
+                if ((r->from = here_document (it)) >= 0)
+                    r->path = NULL;
+                else
+                {
+                    perror ("Unable to create a here-document");
+                    r->path  = "/dev/null";
+                    r->flags = O_IN;
+                }
+                break;
+        }
+    }
+}
+
+/* Only here-documents are duplicated from an fd above stderr */
+static void
+release_plan (const redir_plan_t* plan)
+{
+    for (int i = 0; i < plan->n; ++i)
+        if (!plan->redirs[i].path && plan->redirs[i].from > STDERR_FILENO)
+            close (plan->redirs[i].from);
+}
+
+/* Text of "<<<" or "<<", its variables expanded if the lexer marked it */
+static int
+here_document (const Expression* e)
+{
+    /* A here-document has its delimiter first, its text may be missing */
+    int i            = e->type == REDIRECTION_HD;
+    const char* text = e->arguments[i] ? e->arguments[i] : "";
+    size_t len;
+
+    if (e->arguments[i] && (MarquesArg (e->arguments, i) & MARQUE_VARIABLE))
+        text = expand_variables (text, &len, 0);
+    else
+        len = strlen (text);
+
+    /* A here-string ends by a newline */
+    if (e->type == REDIRECTION_HS)
+    {
+        char* line = arena_alloc (ArenaCourante, len + 1);
+        memcpy (line, text, len);
+        line[len++] = '\n';
+        text        = line;
+    }
+
+    return here_fd (text, len);
+}
+
+/* Small texts fit in the buffer of a pipe, larger ones in a sealed memfd */
+/* Either way nothing touches the disk and no process has to feed it */
+static int
+here_fd (const char* text, size_t len)
+{
+    int fd = -1;
+
+    if (len <= PIPE_BUF)
+    {
+        int pipefd[2];
+
+        if (pipe2 (pipefd, O_CLOEXEC) < 0)
+            return -1;
+        /* Atomic and never blocking in an empty pipe */
+        if (len && write (pipefd[1], text, len) != (ssize_t) len)
+        {
+            close (pipefd[0]);
+            pipefd[0] = -1;
+        }
+        close (pipefd[1]);
+        return pipefd[0];
+    }
+
+#if defined(__linux__) && defined(SYS_memfd_create)
+    fd = syscall (
+        SYS_memfd_create, "here-document", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#endif
+    /* An unlinked file elsewhere */
+    if (fd < 0)
+    {
+        char path[] = "/tmp/minishell-here-XXXXXX";
+        if ((fd = mkstemp (path)) < 0)
+            return -1;
+        unlink (path);
+        fcntl (fd, F_SETFD, FD_CLOEXEC);
+    }
+
+    for (size_t done = 0; done < len;)
+    {
+        ssize_t n = write (fd, text + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            close (fd);
+            return -1;
+        }
+        done += n;
+    }
+
+#ifdef __linux__
+    /* Commands only get a copy that cannot change anymore */
+    fcntl (fd,
+           F_ADD_SEALS,
+           F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+    if (lseek (fd, 0, SEEK_SET) < 0)
+    {
+        close (fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Apply a plan, only done in a child */
+static int
+apply_plan (const redir_plan_t* plan)
+{
+    for (int i = 0; i < plan->n; ++i)
+    {
+        const redir_t* r = &plan->redirs[i];
+        int fd           = r->from;
+
+        if (r->path && (fd = open (r->path, r->flags, S_MODE)) == -1)
+        {
+            fprintf (stderr, "%s: %s\n", r->path, strerror (errno));
+            return -1;
+        }
+
+        /* Opened where it belongs, it must survive exec */
+        if (fd == r->fd)
+        {
+            if (fcntl (fd, F_SETFD, 0) == -1)
+                return -1;
+            continue;
+        }
+
+        if (dup2 (fd, r->fd) == -1)
+        {
+            perror ("Unable to redirect");
+            return -1;
+        }
+        if (r->path)
+            close (fd);
+    }
+
+    return 0;
+}
+
+/* Same as apply_plan, done by posix_spawn in the child */
+static int
+plan_actions (const redir_plan_t* plan, posix_spawn_file_actions_t* actions)
+{
+    int err;
+
+    if ((err = posix_spawn_file_actions_init (actions)) != 0)
+        return err;
+
+    for (int i = 0; i < plan->n; ++i)
+    {
+        const redir_t* r = &plan->redirs[i];
+
+        /* The file is opened on its fd, it must not be closed on exec */
+        if (r->path)
+            err = posix_spawn_file_actions_addopen (
+                actions, r->fd, r->path, r->flags & ~O_CLOEXEC, S_MODE);
+        else
+            err = posix_spawn_file_actions_adddup2 (actions, r->from, r->fd);
+
+        if (err != 0)
+        {
+            posix_spawn_file_actions_destroy (actions);
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+/* Launch a redirected expression, the shell's own fds are never touched */
+static int
+lay_redirection (const Expression* e, int options, int notify)
+{
+    redir_plan_t plan;
+
+    compile_redirections (e, &plan);
+
+    /* Redirected in the child */
+    if (plan.cmd->type == SIMPLE)
+    {
+        const char* saved = line_cur;
+        char** argv       = expand_arguments (plan.cmd->arguments);
+        int wstatus;
+
+        line_cur = job_line (e, NULL);
+        wstatus  = start_cmd (*argv, argv, options, notify, &plan);
+        line_cur = saved;
+        release_plan (&plan);
+        return wstatus;
+    }
+
+    /* Anything else is redirected as a whole in a subshell */
+    fflush (stdout);
+
+    pid_t pid = fork ();
+    if (pid != 0)
+        release_plan (&plan);
+    if (pid < 0)
+    {
+        perror ("Unable to fork");
+        return INTERNSTATUS + 1;
+    }
+
+    if (!pid)
+    {
+        enter_subshell ();
+
+        if (apply_plan (&plan) < 0)
+            exit (1);
+        release_plan (&plan);
+
+        tail_exec   = 1;
+        int wstatus = expression_handler (plan.cmd, JFG, 0);
+        STATUS (wstatus);
+        exit (wstatus);
+    }
+
+    job_t* job = register_job (&pid,
+                               1,
+                               subshell ? getpgrp () : pid,
+                               options,
+                               "Subshell",
+                               job_line (e, NULL));
+
+    /* No more memory available */
+    if (!job)
+    {
+        perror ("Unable to register a new job");
+        return INTERNSTATUS + 1;
+    }
+
+    launch_job (job, notify);
+
+    if (options == JFG)
+        return JOB_STATUS (job);
+    else
+        return INTERNSTATUS;
+}
+
+/* A forked child running an expression, the parent handles it as one job */
+static void
+enter_subshell (void)
+{
+    if (!subshell)
+    {
+        register_signals (&sigdfl);
+        if (setpgid (0, 0) < 0)
+            perror ("Unable to get pgid");
+    }
+
+    /* A batch shell child still has the SIGCHLD handler, its children must
+     * not wake up the parent's reaper */
+    init_reaper ();
+
+    subshell    = 1;
+    interactive = 0;
+}
+
+/********************
+ * Command handling *
+ ********************/
+
+/* Start a sequence */
+static int
+start_sequence (const Expression* e, int options, int notify)
+{
+    /* Create a job if it's a background sequence */
+    if (options == JBG)
+    {
+        /* Children must not inherit pending output */
+        fflush (stdout);
+
+        pid_t pid = fork ();
+        if (pid < 0)
+        {
+            perror ("Unable to fork");
+            return INTERNSTATUS + 1;
+        }
+
+        if (!pid)
+        {
+            /* The whole sequence is one job, handled by the parent shell */
+            enter_subshell ();
+
+            tail_exec   = 1;
+            int wstatus = run_expression (e, notify);
+            STATUS (wstatus);
+            exit (wstatus);
+        }
+
+        job_t* job = register_job (&pid,
+                                   1,
+                                   subshell ? getpgrp () : pid,
+                                   JBG,
+                                   "Sequence",
+                                   job_line (e, NULL));
+
+        /* No more memory available */
+        if (!job)
+        {
+            perror ("Unable to register a new job");
+            return INTERNSTATUS + 1;
+        }
+
+        launch_job (job, notify);
+        return INTERNSTATUS;
+    }
+
+    return run_expression (e, notify);
+}
+
+/* Internal commands "fg" and "bg" */
+static int
+cmd_jobctrl (char* job_cmd, int bg)
+{
+    job_t* tmp;
+    int ambiguous;
+
+    /* Find by jid, command line or name */
+    if (job_cmd)
+    {
+        if ((tmp = find_job_arg (job_cmd, &ambiguous)) == NULL)
+        {
+            fprintf (stderr,
+                     ambiguous ? "%s: ambiguous job: %s\n"
+                               : "%s: job not found: %s\n",
+                     bg == JBG ? "bg" : "fg",
+                     job_cmd);
+            return 1;
+        }
+    }
+    /* Find by last job, none to be fg'd */
+    else if ((tmp = current_job ()) == NULL)
+    {
+        fprintf (stderr, "%s: no job to resume\n", bg ? "bg" : "fg");
+        return 1;
+    }
+
+    if (bg == JBG && JOB_STATE (tmp) == JRUNNING)
+    {
+        fprintf (stderr,
+                 "%s: job already in background\n",
+                 pool_string (tmp->name));
+        return 1;
+    }
+
+    fprintf (stdout, "[%d]+ Resumed\t%s\n", tmp->jid, pool_string (tmp->line));
+    if (bg == JBG)
+        send_to_background (tmp);
+    else
+        send_to_foreground (tmp);
+
+    return 0;
+}
+
+/* Parse a size */
+static int
+parse_size (const char* str, int* size)
+{
+    long mult = 1;
+    char* end;
+    long val;
+
+    errno = 0;
+    val   = strtol (str, &end, 10);
+    if (errno || end == str || val < 0)
+        return -1;
+
+    switch (*end)
+    {
+        case 'g':
+        case 'G':
+            mult = 1024L * 1024 * 1024;
+            ++end;
+            break;
+        case 'm':
+        case 'M':
+            mult = 1024L * 1024;
+            ++end;
+            break;
+        case 'k':
+        case 'K':
+            mult = 1024;
+            ++end;
+            break;
+    }
+
+    /* Checked before multiplying, which could overflow */
+    if (*end != '\0' || val > INT_MAX / mult)
+        return -1;
+
+    *size = val * mult;
+    return 0;
+}
+
+/* Display the value of an option */
+static void
+display_option (const option_t* opt)
+{
+    if (opt->type == OPT_BOOL)
+        fprintf (stdout, "%s\t%s\n", opt->name, *opt->value ? "on" : "off");
+    else if (*opt->value)
+        fprintf (stdout, "%s\t%d\n", opt->name, *opt->value);
+    else
+        fprintf (stdout, "%s\tdefault\n", opt->name);
+}
+
+/* Internal command "set" */
+static int
+cmd_set (char** argv)
+{
+    const option_t* opt;
+
+    /* List all options */
+    if (argv[1] == NULL)
+    {
+        for (opt = options_list; opt->name; ++opt)
+            display_option (opt);
+        return 0;
+    }
+
+    for (opt = options_list; opt->name; ++opt)
+        if (strcmp (opt->name, argv[1]) == 0)
+            break;
+
+    if (!opt->name)
+    {
+        fprintf (stderr, "set: unknown option: %s\n", argv[1]);
+        return 1;
+    }
+
+    /* Display one option */
+    if (argv[2] == NULL)
+    {
+        display_option (opt);
+        return 0;
+    }
+
+    switch (opt->type)
+    {
+        case OPT_BOOL:
+            if (strcmp (argv[2], "on") == 0)
+                *opt->value = 1;
+            else if (strcmp (argv[2], "off") == 0)
+                *opt->value = 0;
+            else
+            {
+                fprintf (stderr, "set: %s: expected on or off\n", opt->name);
+                return 1;
+            }
+            if (opt->value == &shopt.forkserver)
+                return update_forkserver ();
+            break;
+
+        case OPT_SIZE:
+            if (strcmp (argv[2], "default") == 0)
+                *opt->value = 0;
+            else if (parse_size (argv[2], opt->value) < 0)
+            {
+                fprintf (stderr,
+                         "set: %s: invalid size: %s\n",
+                         opt->name,
+                         argv[2]);
+                return 1;
+            }
+            break;
+    }
+
+    return 0;
+}
+
+/* Find an internal command, one probe then a check of its name */
+static const builtin_t*
+find_builtin (const char* cmd)
+{
+    int i = builtins_table[builtin_hash (cmd, BUILTINS_SEED)
+                           & (BUILTINS_SIZE - 1)];
+
+    if (i < 0 || strcmp (builtins_list[i].name, cmd) != 0)
+        return NULL;
+    return &builtins_list[i];
+}
+
+/* Name of the i-th internal command, NULL past the last one */
+const char*
+builtin_name (size_t i)
+{
+    if (i >= sizeof builtins_list / sizeof *builtins_list)
+        return NULL;
+    return builtins_list[i].name;
+}
+
+/* Exit terminal */
+static int
+cmd_exit (char** argv)
+{
+    EndOfFile ();
+    return 0;
+}
+
+/* Print its arguments or last exit code */
+static int
+cmd_echo (char** argv)
+{
+    char* arg;
+
+    if (argv[1] == NULL)
+        return 0;
+    while ((arg = *++argv))
+    {
+        printf ("%s", arg);
+        if (*(argv + 1))
+            printf (" ");
+    }
+    printf ("\n");
+    return 0;
+}
+
+/* Change working directory */
+static int
+cmd_cd (char** argv)
+{
+    /* TODO: if no argument go to ~ */
+    if (argv[1] == NULL)
+        return 0;
+    if (chdir (*(argv + 1)) == 0)
+        return 0;
+    fprintf (stderr,
+             "Unable to change directory: %s (%s)\n",
+             strerror (errno),
+             *argv + 1);
+    return 1;
+}
+
+/* Display help */
+static int
+cmd_help (char** argv)
+{
+    fprintf (stdout,
+             "MiniShell - ProgSys 2020-21\nPierre Boisselier "
+             "<pierre.boisselier@etu.u-bordeaux.fr>\n\nThose shell commands "
+             "are defined "
+             "internally.\n\n");
+    for (size_t i = 0; i < sizeof builtins_list / sizeof *builtins_list; ++i)
+        fprintf (stdout, "\t%s\n", builtins_list[i].help);
+    for (const char** str = prefix_help; *str; ++str)
+        fprintf (stdout, "\t%s\n", *str);
+    fprintf (stdout, "\n");
+    fprintf (stdout,
+             "Jobs of fg, bg and wait:\n\t- %%jid: Job number\n\t- "
+             "%%prefix: Command line starting with prefix\n\t- %%?text: "
+             "Command line containing text, every job is scanned\n\t- "
+             "%%, %%%%, %%+: Current job\n\t- name: Exact name of the "
+             "job\n\n");
+    fprintf (stdout,
+             "Keyboard shortcuts:\n\t- Ctrl-Z: Suspend current job in "
+             "foreground\n\t- Ctrl-C: Interrupt current foreground job\n\n");
+    return 0;
+}
+
+/* Command location table */
+static int
+cmd_hash (char** argv)
+{
+    char* arg;
+    int wstatus = 0;
+
+    if (argv[1] == NULL || strcmp (argv[1], "-l") == 0)
+    {
+        hash_print (stdout);
+        return 0;
+    }
+    if (strcmp (argv[1], "-r") == 0)
+    {
+        hash_reset ();
+        return 0;
+    }
+    while ((arg = *++argv))
+        if (hash_add (arg) < 0)
+        {
+            fprintf (stderr, "hash: %s: not found\n", arg);
+            wstatus = 1;
+        }
+    return wstatus;
+}
+
+/* Internal command "history", the whole file is searched, not only what
+ * readline has */
+static int
+cmd_history (char** argv)
+{
+    const char* pattern = NULL;
+    long n              = 0;
+    char* end;
+
+    if (argv[1] && strcmp (argv[1], "-s") == 0)
+    {
+        if (!(pattern = argv[2]))
+        {
+            fprintf (stderr, "history: -s needs a pattern\n");
+            return 1;
+        }
+        argv += 2;
+    }
+    if (argv[1])
+    {
+        n = strtol (argv[1], &end, 10);
+        if (*end || n < 0)
+        {
+            fprintf (stderr, "history: invalid count: %s\n", argv[1]);
+            return 1;
+        }
+    }
+
+    if (history_print (stdout, n, pattern) < 0)
+    {
+        perror ("history");
+        return 1;
+    }
+    return 0;
+}
+
+/* Export variables, or list exported ones */
+static int
+cmd_export (char** argv)
+{
+    int ret = 0;
+
+    if (!argv[1])
+    {
+        env_print (stdout, 1);
+        return 0;
+    }
+
+    while (*++argv)
+    {
+        size_t len = env_name_length (*argv);
+
+        if (!len || ((*argv)[len] != '\0' && (*argv)[len] != '='))
+        {
+            fprintf (stderr, "export: invalid name: %s\n", *argv);
+            ret = 1;
+        }
+        else if ((*argv)[len] == '=')
+        {
+            if (env_set (*argv, len, *argv + len + 1, 1) < 0)
+            {
+                perror ("export");
+                ret = 1;
+            }
+        }
+        /* Exporting an unset variable does nothing */
+        else
+            env_export (*argv, len);
+    }
+    return ret;
+}
+
+/* Remove variables */
+static int
+cmd_unset (char** argv)
+{
+    int ret = 0;
+
+    while (*++argv)
+    {
+        size_t len = env_name_length (*argv);
+
+        if (!len || (*argv)[len] != '\0')
+        {
+            fprintf (stderr, "unset: invalid name: %s\n", *argv);
+            ret = 1;
+        }
+        else
+            env_unset (*argv, len);
+    }
+    return ret;
+}
+
+/* List all jobs, with their times if "-l" */
+static int
+cmd_jobs (char** argv)
+{
+    int verbose = argv[1] && strcmp (argv[1], "-l") == 0;
+
+    for (int i = 0; i < job_slots; ++i)
+        if (job_hot.pid[i] != 0)
+        {
+            display_job (job_list[i]);
+            if (verbose)
+                display_usage (job_list[i]);
+            if (verbose && *job_list[i]->place)
+                fprintf (stdout, "\ton %s\n", job_list[i]->place);
+        }
+    return 0;
+}
+
+/* Send to foreground */
+static int
+cmd_fg (char** argv)
+{
+    return cmd_jobctrl (argv[1], JFG);
+}
+
+/* Send to background */
+static int
+cmd_bg (char** argv)
+{
+    return cmd_jobctrl (argv[1], JBG);
+}
+
+/* Most recent job not done, NULL if none */
+static job_t*
+current_job (void)
+{
+    /* Find the most recent job (pid higher) if there are none in last_job
+     * or it's already done */
+    if (!last_job || JOB_STATE (last_job) == JDONE)
+    {
+        last_job = NULL;
+        for (int i = 0; i < job_slots; ++i)
+            if (job_hot.pid[i] != 0 && job_hot.state[i] != JDONE
+                && (!last_job || job_hot.pid[i] >= JOB_PID (last_job)))
+                last_job = job_list[i];
+    }
+    return last_job;
+}
+
+/* Find a job from "%jid", "%prefix", "%?text", "jid" or its name, sets
+ * ambiguous if more than one matches */
+static job_t*
+find_job_arg (const char* arg, int* ambiguous)
+{
+    const char* s = *arg == '%' ? arg + 1 : arg;
+    job_t* found  = NULL;
+    char* end;
+    long jid = strtol (s, &end, 10);
+    size_t len;
+    int at;
+
+    *ambiguous = 0;
+
+    /* The jid is the slot */
+    if (*s && !*end)
+        return jid >= 0 && jid < job_slots && job_hot.pid[jid]
+                   ? job_list[jid]
+                   : NULL;
+
+    /* A name is exact, as before "%" */
+    if (s == arg)
+        return find_job_name (s);
+
+    /* "%", "%%" and "%+" are the current job, not every command line */
+    if (!*s || strcmp (s, "%") == 0 || strcmp (s, "+") == 0)
+        return current_job ();
+
+    /* Anywhere in the command line, every one must be tried */
+    if (*s == '?')
+    {
+        for (int i = 0; i < job_count; ++i)
+            if (strstr (pool_string (job_order[i]->line), s + 1))
+            {
+                *ambiguous = found != NULL;
+                if (found)
+                    return NULL;
+                found = job_order[i];
+            }
+        return found;
+    }
+
+    /* The command lines starting with it follow each other */
+    len = strlen (s);
+    at  = order_search (s, -1);
+    if (at >= job_count
+        || strncmp (pool_string (job_order[at]->line), s, len) != 0)
+        return NULL;
+    if (at + 1 < job_count
+        && strncmp (pool_string (job_order[at + 1]->line), s, len) == 0)
+    {
+        *ambiguous = 1;
+        return NULL;
+    }
+    return job_order[at];
+}
+
+/* Wait for jobs in background, every one or the first done if "-n" */
+static int
+cmd_wait (char** argv)
+{
+    int any     = argv[1] && strcmp (argv[1], "-n") == 0;
+    int n       = 0;
+    int pending = 0;
+    int ret     = 0;
+    int words   = 0;
+    int all;
+    struct sigaction saved_chld;
+    job_t** jobs;
+    int ambiguous;
+
+    /* Past the options, the list header is not there anymore */
+    argv += any + 1;
+    while (argv[words])
+        ++words;
+    all = !words && !any;
+    jobs = arena_alloc (ArenaCourante,
+                        (words ? words : job_slots) * sizeof *jobs);
+
+    /* Jobs given, or every job in background */
+    if (*argv)
+        for (; *argv; ++argv)
+        {
+            if ((jobs[n] = find_job_arg (*argv, &ambiguous)) == NULL)
+            {
+                fprintf (stderr,
+                         ambiguous ? "wait: ambiguous job: %s\n"
+                                   : "wait: job not found: %s\n",
+                         *argv);
+                ret = 127;
+                continue;
+            }
+            ++n;
+        }
+    else
+        for (int i = 0; i < job_slots; ++i)
+            if (job_hot.pid[i] != 0 && job_list[i]->background == JBG)
+                jobs[n++] = job_list[i];
+
+    /* Be woken up by every child, even in a subshell */
+    if (subshell)
+        init_reaper ();
+    sigaction (SIGCHLD, &sigact, &saved_chld);
+    sigint_flag = 0;
+
+    /* Stopped jobs would never end, only running ones are waited */
+    while (n && !sigint_flag)
+    {
+        int done = 0;
+
+        pending = 0;
+        for (int i = 0; i < n && !(any && done); ++i)
+            if (JOB_PID (jobs[i]) != 0 && JOB_STATE (jobs[i]) == JRUNNING)
+                jobs[pending++] = jobs[i];
+            else if (JOB_PID (jobs[i]) != 0 && JOB_STATE (jobs[i]) == JDONE)
+            {
+                /* Reported by its status, rather than when done, "wait"
+                 * alone is always 0 */
+                if (!all)
+                    ret = jobs[i]->termsig ? 128 + jobs[i]->termsig
+                                           : JOB_STATUS (jobs[i]);
+                unregister_job (jobs[i]);
+                done = 1;
+            }
+        if ((any && done) || !(n = pending))
+            break;
+
+        wait_children (jobs, n, WUNTRACED | WCONTINUED);
+    }
+
+    sigaction (SIGCHLD, &saved_chld, NULL);
+    return sigint_flag ? 128 + SIGINT : ret;
+}
+
+/* Start a task in background, its output goes to a file if keep */
 static void
-grim_reaper (void)
+start_task (task_t* task, const char* line, int keep)
 {
-    /* Iterator */
-    job_t* job = job_list;
-
+    Expression* e = AnalyserCommande (line);
     int wstatus;
-    pid_t pid;
 
-    for (int i = 0; i < MAXJOBS; ++i, job = &job_list[i])
-        if (job->pid > 0) /* Only reap job that actually exist */
-            if (waitpid (job->pid, &wstatus, WUNTRACED | WCONTINUED | WNOHANG)
-                > 0)
-                set_status_job (job, wstatus);
-            else if (kill (job->pid, 0) == -1)
-                /* If the job "exists" but the linked process does not, remove it */
-                if (errno == ESRCH)
-                    unregister_job (job);
+    task->fd = -1;
+    task->job = NULL;
+
+    if (!e)
+    {
+        task->done   = 1;
+        task->status = 2;
+        return;
+    }
+
+    /* Redirected as "line > file", the child opens it by name */
+    if (keep)
+    {
+        static const char template[] = "/tmp/minishell-XXXXXX";
+        char* path = arena_strndup (ArenaCourante, template, sizeof template);
+        if ((task->fd = mkstemp (path)) < 0)
+            perror ("parallel: unable to keep output");
+        else
+        {
+            fcntl (task->fd, F_SETFD, FD_CLOEXEC);
+            task->path = path;
+            e          = ConstruireNoeud (
+                REDIRECTION_O,
+                e,
+                NULL,
+                AjouterArg (InitialiserListeArguments (), path, strlen (path)));
+        }
+    }
+
+    /* Its job is the last one started, unless it ran in the shell */
+    last_job = NULL;
+    wstatus  = expression_handler (e, JBG, 0);
+    if (last_job)
+        task->job = last_job;
+    else
+    {
+        STATUS (wstatus);
+        task->done   = 1;
+        task->status = wstatus;
+    }
 }
 
-/***********************
- * Prepare for command *
- ***********************/
+/* Collect a task done */
+static int
+end_task (task_t* task)
+{
+    if (!task->job || JOB_STATE (task->job) != JDONE)
+        return 0;
+
+    task->status = JOB_STATUS (task->job);
+    task->done   = 1;
+    unregister_job (task->job);
+    task->job = NULL;
+    return 1;
+}
+
+/* Print the output kept for a task */
+static void
+flush_task (task_t* task)
+{
+    char buf[4096];
+    ssize_t n;
+
+    if (task->fd < 0)
+        return;
+
+    fflush (stdout);
+    lseek (task->fd, 0, SEEK_SET);
+    while ((n = read (task->fd, buf, sizeof buf)) > 0)
+        if (write (STDOUT_FILENO, buf, n) < 0)
+            break;
+
+    close (task->fd);
+    unlink (task->path);
+    task->fd = -1;
+}
+
+/* Read command lines from stdin, one per line */
+static char**
+read_tasks (int* n)
+{
+    FILE* in = NULL;
+    char* line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    char** lines = InitialiserListeArguments ();
+    int fd       = dup (STDIN_FILENO);
+
+    /* Read through our own stream, the one of stdin may hold stale data */
+    if (fd < 0 || (in = fdopen (fd, "r")) == NULL)
+    {
+        perror ("parallel");
+        if (fd >= 0)
+            close (fd);
+        *n = 0;
+        return lines;
+    }
+
+    while ((len = getline (&line, &cap, in)) > 0)
+    {
+        if (line[len - 1] == '\n')
+            --len;
+        if (len)
+            lines = AjouterArg (lines, line, len);
+    }
 
-/* Create a pipe and launch attached jobs */
-// TODO: Fix pipe with sequences not working correctly
+    free (line);
+    fclose (in);
+    *n = LongueurListe (lines);
+    return lines;
+}
+
+/* Run command lines with at most N of them at once */
 static int
-lay_pipeline (const Expression* e, int options)
+cmd_parallel (char** argv)
 {
-    int wstatus;
-    int pipefd[2];
+    long max  = sysconf (_SC_NPROCESSORS_ONLN);
+    int keep  = 0;
+    int n     = 0;
+    int next  = 0;
+    int out   = 0;
+    int running = 0;
+    int failed  = 0;
+    job_t* saved_last = last_job;
+    struct sigaction saved_chld;
+    char** lines;
+    task_t* tasks;
+
+    /* Options */
+    while (*++argv && **argv == '-')
+        if (strcmp (*argv, "-j") == 0 && argv[1])
+        {
+            char* end;
+            max = strtol (*++argv, &end, 10);
+            if (*end || max <= 0)
+            {
+                fprintf (stderr, "parallel: invalid job count: %s\n", *argv);
+                return 1;
+            }
+        }
+        else if (strcmp (*argv, "--keep-order") == 0)
+            keep = 1;
+        else if (strcmp (*argv, "--") == 0)
+        {
+            ++argv;
+            break;
+        }
+        else
+        {
+            fprintf (stderr,
+                     "parallel: usage: parallel [-j N] [--keep-order] "
+                     "[command ...]\n");
+            return 1;
+        }
 
-    /* O_CLOEXEC closes the pipe's file descriptors on exec
-     This prevents the pipe from being opened and having a background process
-     never ending */
-    if (pipe2 (pipefd, O_CLOEXEC) == -1)
-        goto err;
+    if (max <= 0)
+        max = 1;
 
-    int out = dup (STDOUT_FILENO);
-    int in  = dup (STDIN_FILENO);
+    /* Arguments, or lines of stdin */
+    if (*argv)
+        for (lines = argv; lines[n]; ++n)
+            ;
+    else
+        lines = read_tasks (&n);
 
-    if (out == -1 || in == -1)
-        goto err;
-    if (dup2 (pipefd[0], STDIN_FILENO) == -1)
-        goto err;
-    if (close (pipefd[0]) == -1)
+    tasks = arena_calloc (ArenaCourante, n, sizeof *tasks);
+
+    /* Be woken up by every child, even in a subshell */
+    if (subshell)
+        init_reaper ();
+    sigaction (SIGCHLD, &sigact, &saved_chld);
+    sigint_flag = 0;
+
+    while (out < n)
+    {
+        /* Fill free slots */
+        while (running < max && next < n && !sigint_flag)
+        {
+            start_task (&tasks[next], lines[next], keep);
+            if (tasks[next++].job)
+                ++running;
+        }
+
+        /* Interrupted, nothing more is started, the tasks are told once
+         * (again only on another Ctrl-C) */
+        if (sigint_flag)
+        {
+            sigint_flag = 0;
+            for (int i = 0; i < next; ++i)
+                if (tasks[i].job)
+                    kill (-JOB_PGID (tasks[i].job), SIGINT);
+            for (; next < n; ++next)
+            {
+                tasks[next].done   = 1;
+                tasks[next].status = 128 + SIGINT;
+                tasks[next].fd     = -1;
+            }
+        }
+
+        /* Wait for a child, the reaper's pipe says when */
+        if (running)
+        {
+            wait_children (NULL, 0, WUNTRACED | WCONTINUED);
+
+            for (int i = 0; i < next; ++i)
+                if (end_task (&tasks[i]))
+                    --running;
+        }
+
+        /* Output in order of the command lines */
+        while (out < next && tasks[out].done)
+            flush_task (&tasks[out++]);
+    }
+
+    sigaction (SIGCHLD, &saved_chld, NULL);
+
+    /* Its jobs are gone, forget them */
+    last_job = saved_last && JOB_PID (saved_last) ? saved_last : NULL;
+
+    /* Exit status is the number of failures, as GNU parallel */
+    for (int i = 0; i < n; ++i)
+        if (tasks[i].status)
+            ++failed;
+    return failed > 100 ? 101 : failed;
+}
+
+/* Handles internal commands */
+static int
+internal_cmd (char* cmd, char** argv)
+{
+    const builtin_t* builtin = find_builtin (cmd);
+
+    /* No internal command found */
+    if (!builtin)
+        return -1;
+    return builtin->handler (argv);
+}
+
+/* Internal commands run in the shell, their fds are saved and restored */
+static int
+redirect_internal (char* cmd, char** argv, const redir_plan_t* plan)
+{
+    /* -2 if untouched, -1 if it was closed */
+    int saved[3] = {-2, -2, -2};
+    int* opened  = arena_alloc (ArenaCourante, plan->n * sizeof *opened);
+    int wstatus  = 1;
+    int i;
+
+    for (i = 0; i < plan->n; ++i)
+        opened[i] = -1;
+
+    /* Open everything first, a missing file changes nothing */
+    for (i = 0; i < plan->n; ++i)
+    {
+        const redir_t* r = &plan->redirs[i];
+        if (r->path && (opened[i] = open (r->path, r->flags, S_MODE)) == -1)
+        {
+            fprintf (stderr, "%s: %s\n", r->path, strerror (errno));
+            goto end;
+        }
+    }
+
+    fflush (stdout);
+    fflush (stderr);
+
+    for (i = 0; i < plan->n; ++i)
+    {
+        const redir_t* r = &plan->redirs[i];
+
+        if (saved[r->fd] == -2)
+            saved[r->fd] = fcntl (r->fd, F_DUPFD_CLOEXEC, 10);
+
+        if (dup2 (r->path ? opened[i] : r->from, r->fd) == -1)
+        {
+            perror ("Unable to redirect");
+            goto restore;
+        }
+    }
+
+    wstatus = internal_cmd (cmd, argv);
+
+restore:
+    fflush (stdout);
+    fflush (stderr);
+
+    for (int fd = 0; fd < 3; ++fd)
+        if (saved[fd] == -1)
+            close (fd);
+        else if (saved[fd] >= 0)
+        {
+            dup2 (saved[fd], fd);
+            close (saved[fd]);
+        }
+
+end:
+    for (i = 0; i < plan->n; ++i)
+        if (opened[i] != -1)
+            close (opened[i]);
+
+    return wstatus;
+}
+
+/* Spawn a command, the child gets the same setup as a forked one */
+/* posix_spawn does not copy the shell's memory (vfork/CLONE_VM on glibc), so
+ * its cost does not grow with the shell's size */
+static pid_t
+spawn_cmd (const char* path,
+           char** argv,
+           const posix_spawn_file_actions_t* actions)
+{
+    posix_spawnattr_t attr;
+    sigset_t sigdef, sigmask;
+    pid_t pid;
+    int err;
+
+    if ((err = posix_spawnattr_init (&attr)) != 0)
         goto err;
 
-    /* Assign a job for each right side of a pipe (read hand) */
-    wstatus = expression_handler (e->droite, JBG, 0);
+    /* Same as register_signals (&sigdfl) */
+    sigemptyset (&sigdef);
+    for (int* s = sigregistered; *s != -1; s++)
+        sigaddset (&sigdef, *s);
+    sigemptyset (&sigmask);
+
+    /* Same as setpgid (0, 0), a subshell keeps its own group */
+    if ((err = posix_spawnattr_setpgroup (&attr, 0)) != 0
+        || (err = posix_spawnattr_setsigdefault (&attr, &sigdef)) != 0
+        || (err = posix_spawnattr_setsigmask (&attr, &sigmask)) != 0
+        || (err = posix_spawnattr_setflags (
+                &attr,
+                (subshell ? 0 : POSIX_SPAWN_SETPGROUP) | POSIX_SPAWN_SETSIGDEF
+                    | POSIX_SPAWN_SETSIGMASK))
+               != 0)
+        goto err2;
+
+    err = posix_spawn (&pid, path, actions, &attr, argv, environ);
+
+err2:
+    posix_spawnattr_destroy (&attr);
+err:
+    if (err == 0)
+        return pid;
+    errno = err;
+    return -1;
+}
+
+/* Launch a command through the fork server, its files are opened here and
+ * sent with it */
+static pid_t
+server_cmd (const char* path, char** argv, const redir_plan_t* plan)
+{
+    int fds[3]  = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    int* opened = NULL;
+    pid_t pid   = -1;
+    int i;
+
+    /* A subshell leaves it to its parent */
+    if (!forkserver_running ())
+        return -1;
+
+    /* Same order as apply_plan, a failure is reported by the fallback */
+    if (plan)
+    {
+        opened = arena_alloc (ArenaCourante, plan->n * sizeof *opened);
+        for (i = 0; i < plan->n; ++i)
+            opened[i] = -1;
+
+        for (i = 0; i < plan->n; ++i)
+        {
+            const redir_t* r = &plan->redirs[i];
+            if (r->path && (opened[i] = open (r->path, r->flags, S_MODE)) == -1)
+                goto end;
+            fds[r->fd] = r->path                    ? opened[i]
+                         : r->from > STDERR_FILENO ? r->from
+                                                   : fds[r->from];
+        }
+    }
+
+    pid = forkserver_spawn (
+        path, argv, environ, fds, subshell ? getpgrp () : 0);
+
+end:
+    if (plan)
+        for (i = 0; i < plan->n; ++i)
+            if (opened[i] != -1)
+                close (opened[i]);
+    return pid;
+}
+
+/* Start or stop the fork server as "set forkserver" says */
+static int
+update_forkserver (void)
+{
+    if (!shopt.forkserver)
+    {
+        forkserver_stop ();
+        return 0;
+    }
+
+    if (forkserver_start () < 0)
+    {
+        perror ("Unable to start the fork server");
+        shopt.forkserver = 0;
+        return 1;
+    }
+    return 0;
+}
+
+/* Replace the current process by a command */
+static void
+exec_cmd (const char* path, char* cmd, char** argv)
+{
+    /* Fallback to a $PATH lookup if the remembered one is stale */
+    if (path)
+        execv (path, argv);
+    execvp (cmd, argv);
+
+    fprintf (stderr, "%s: command not found\n", cmd);
+    exit (1);
+}
+
+/* Expand variables and commands, then patterns; a pattern matching nothing
+ * is kept as it is. Only the output of commands outside quotes is split
+ * into fields, they are added without being copied again */
+static char**
+expand_arguments (char** argv)
+{
+    int leading = 1;
+    char** expanded;
+
+    if (!MarquesListe (argv))
+        return argv;
+
+    expanded = InitialiserListeArguments ();
+    for (int i = 0; argv[i]; ++i)
+    {
+        int marks = MarquesArg (argv, i);
+        char* arg = argv[i];
+        int pattern, split;
+        char* end;
+        size_t len;
+
+        /* Values of assignments are neither split nor patterns */
+        leading = leading && is_assignment (arg);
+        pattern = (marks & MARQUE_MOTIF) && !leading;
+        split   = (marks & MARQUE_CHAMPS) && !leading;
+        if (!(marks & MARQUE_VARIABLE))
+        {
+            expanded = pattern ? add_field (expanded, arg, 1)
+                               : AjouterArg (expanded, arg, strlen (arg));
+            continue;
+        }
+
+        arg = expand_variables (arg, &len, split);
+        if (!split)
+        {
+            expanded = add_field (expanded, arg, pattern);
+            continue;
+        }
+
+        /* Fields end at each '\0', empty ones are dropped */
+        for (end = arg + len; arg < end; arg += strlen (arg) + 1)
+            if (*arg)
+                expanded = add_field (expanded, arg, pattern);
+
+        /* Still a command if every word was empty */
+        if (!argv[i + 1] && !*expanded)
+            expanded = AjouterChaine (expanded, end);
+    }
+    return expanded;
+}
+
+/* Add a field of an expanded argument, or the paths it matches */
+static char**
+add_field (char** list, char* field, int pattern)
+{
+    char** paths = NULL;
+    size_t n     = 0;
+
+    if (pattern)
+        paths = glob_expand (field, ArenaCourante, &n);
+    if (!paths)
+        return AjouterChaine (list, field);
+    for (size_t j = 0; j < n; ++j)
+        list = AjouterChaine (list, paths[j]);
+    return list;
+}
+
+/* Make room for n more characters in an expansion */
+static void
+expbuf_reserve (expbuf_t* b, size_t n)
+{
+    size_t size = b->cap ? b->cap : 256;
+    char* s;
+
+    if (b->len + n + 1 <= b->cap)
+        return;
+    while (b->len + n + 1 > size)
+        size *= 2;
+
+    /* The arena never fails, the old buffer is left in it */
+    s = arena_alloc (ArenaCourante, size);
+    if (b->len)
+        memcpy (s, b->s, b->len);
+    b->s   = s;
+    b->cap = size;
+}
+
+/* Append n characters to an expansion */
+static void
+expbuf_append (expbuf_t* b, const char* s, size_t n)
+{
+    expbuf_reserve (b, n);
+    memcpy (b->s + b->len, s, n);
+    b->len += n;
+    b->s[b->len] = '\0';
+}
+
+/* The ')' closing a "$(" just before s, NULL if none */
+static const char*
+subst_end (const char* s)
+{
+    int depth = 1;
+
+    for (; *s; ++s)
+        if (*s == '(')
+            ++depth;
+        else if (*s == ')' && --depth == 0)
+            return s;
+    return NULL;
+}
+
+/* Append the output of a command of n characters to an expansion, read
+ * straight into its buffer; trailing newlines are removed and, if split,
+ * blanks become '\0'. A builtin that only prints runs without a fork */
+static void
+substitute (const char* text, size_t n, expbuf_t* b, int split)
+{
+    Expression* e = AnalyserCommande (arena_strndup (ArenaCourante, text, n));
+    size_t start  = b->len;
+    const builtin_t* builtin;
+    char** argv;
+    char* out;
+    size_t len;
+    int wstatus, fds[2];
+    ssize_t r;
+    pid_t pid;
+
+    if (!e)
+    {
+        laststatus = 2;
+        return;
+    }
+
+    if (e->type == SIMPLE && *(argv = expand_arguments (e->arguments))
+        && (builtin = find_builtin (*argv)) && (builtin->flags & BUILTIN_PIPE)
+        && (wstatus = capture_internal (argv, &out, &len)) >= 0)
+        expbuf_append (b, out, len);
+    else
+    {
+        if (pipe2 (fds, O_CLOEXEC) < 0)
+        {
+            perror ("Unable to create pipe");
+            return;
+        }
+        fflush (stdout);
+        if ((pid = fork ()) < 0)
+        {
+            perror ("Unable to fork");
+            close (fds[0]);
+            close (fds[1]);
+            return;
+        }
+
+        /* Left in the group of the shell, ^C stops it with the line */
+        if (pid == 0)
+        {
+            if (!subshell)
+                register_signals (&sigdfl);
+            init_reaper ();
+            subshell    = 1;
+            interactive = 0;
+
+            dup2 (fds[1], STDOUT_FILENO);
+            close (fds[0]);
+            close (fds[1]);
+            tail_exec = 1;
+            wstatus   = expression_handler (e, JFG, 0);
+            STATUS (wstatus);
+            fflush (stdout);
+            _exit (wstatus);
+        }
+
+        close (fds[1]);
+        for (;;)
+        {
+            expbuf_reserve (b, SUBST_CHUNK);
+            r = read (fds[0], b->s + b->len, b->cap - b->len - 1);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0)
+                break;
+            b->len += r;
+        }
+        close (fds[0]);
+        b->s[b->len] = '\0';
+
+        while (waitpid (pid, &wstatus, 0) < 0 && errno == EINTR)
+            ;
+        wstatus = WIFSIGNALED (wstatus) ? 128 + WTERMSIG (wstatus)
+                                        : WEXITSTATUS (wstatus);
+    }
+    laststatus = wstatus;
+
+    while (b->len > start && b->s[b->len - 1] == '\n')
+        b->s[--b->len] = '\0';
+    if (split)
+        for (char* p = b->s + start; p < b->s + b->len; ++p)
+            if (*p == ' ' || *p == '\t' || *p == '\n')
+                *p = '\0';
+}
+
+/* Expand $NAME, ${NAME}, $?, $$ and $(cmd) in one pass, into a buffer of
+ * the arena; an unset variable is empty, another '$' is kept */
+static char*
+expand_variables (const char* s, size_t* len, int split)
+{
+    expbuf_t b = {NULL, 0, 0};
+    const char* p;
+    const char* end;
+    char num[24];
+
+    expbuf_reserve (&b, strlen (s));
+    while ((p = strchr (s, '$')))
+    {
+        const char* value = "$";
+        size_t skip       = 1;
+        size_t n;
+
+        if (p[1] == '(' && (end = subst_end (p + 2)))
+        {
+            expbuf_append (&b, s, p - s);
+            substitute (p + 2, end - p - 2, &b, split);
+            s = end + 1;
+            continue;
+        }
+        else if (p[1] == '?' || p[1] == '$')
+        {
+            snprintf (num, sizeof num, "%d", p[1] == '?' ? laststatus : shpid);
+            value = num;
+            skip  = 2;
+        }
+        else if (p[1] == '{' && (n = env_name_length (p + 2))
+                 && p[n + 2] == '}')
+        {
+            value = env_get (p + 2, n);
+            skip  = n + 3;
+        }
+        else if ((n = env_name_length (p + 1)))
+        {
+            value = env_get (p + 1, n);
+            skip  = n + 1;
+        }
+
+        expbuf_append (&b, s, p - s);
+        if (value)
+            expbuf_append (&b, value, strlen (value));
+        s = p + skip;
+    }
+    expbuf_append (&b, s, strlen (s));
+    *len = b.len;
+    return b.s;
+}
+
+/* Non zero if s is "NAME=value" */
+static int
+is_assignment (const char* s)
+{
+    size_t len = env_name_length (s);
+    return len && s[len] == '=';
+}
+
+/* Set the variables of the first n arguments, exported if export */
+static int
+assign_variables (char** argv, int n, int export)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        size_t len = env_name_length (argv[i]);
+        if (env_set (argv[i], len, argv[i] + len + 1, export) < 0)
+        {
+            perror (argv[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
 
-    if (dup2 (in, STDIN_FILENO) == -1)
-        goto err;
-    if (dup2 (pipefd[1], STDOUT_FILENO) == -1)
-        goto err;
-    if (close (pipefd[1]) == -1)
-        goto err;
+/* Launch "NAME=value ... cmd", or set the variables without cmd */
+static int
+start_assigned (char** argv, int options, int notify, const redir_plan_t* plan)
+{
+    const char** saved;
+    int* exported;
+    int wstatus, n, i;
+
+    for (n = 0; argv[n] && is_assignment (argv[n]); ++n)
+        ;
+    if (!argv[n])
+        return assign_variables (argv, n, 0) < 0 ? 1 : 0;
+
+    /* Only the command sees them, the previous values are restored after */
+    saved    = arena_alloc (ArenaCourante, n * sizeof *saved);
+    exported = arena_alloc (ArenaCourante, n * sizeof *exported);
+    for (i = 0; i < n; ++i)
+    {
+        size_t len        = env_name_length (argv[i]);
+        const char* value = env_get (argv[i], len);
 
-    /* Start in foreground the most-left command */
-    wstatus = expression_handler (e->gauche, options, 0);
+        saved[i]
+            = value ? arena_strndup (ArenaCourante, value, strlen (value))
+                    : NULL;
+        exported[i] = env_exported (argv[i], len);
+    }
 
-    if (dup2 (out, STDOUT_FILENO) == -1)
-        goto err;
+    if (assign_variables (argv, n, 1) < 0)
+        wstatus = 1;
+    else
+        wstatus = start_cmd (argv[n], argv + n, options, notify, plan);
 
-    /* Close renmant pipes, if more than one pipe */
-    if (close (out) < 0 || close (in) < 0)
-        goto err;
+    /* Backwards, the first value of a variable assigned twice is the one */
+    for (i = n; i-- > 0;)
+    {
+        size_t len = env_name_length (argv[i]);
 
+        env_unset (argv[i], len);
+        if (saved[i])
+            env_set (argv[i], len, saved[i], exported[i]);
+    }
     return wstatus;
-
-err:
-    perror ("Unable to set pipe");
-    return -1;
 }
 
-/* Redirect i/o to a file, returns its file descriptor */
+/* Start the command accordingly */
 static int
-lay_redirection (const Expression* e, int options)
+start_cmd (char* cmd,
+           char** argv,
+           int options,
+           int notify,
+           const redir_plan_t* plan)
 {
-    int flags = O_OUT;
-    int fd;
+    posix_spawn_file_actions_t actions;
     int wstatus;
+    pid_t pid = -1;
 
-    /* Save current fd */
-    int out = dup (STDOUT_FILENO);
-    int in  = dup (STDIN_FILENO);
-    int err = dup (STDERR_FILENO);
-    if (out == -1 || in == -1 || err == -1)
-        goto err;
+    /* "pipebuf size" only matters for a pipeline */
+    if (strcmp (cmd, "pipebuf") == 0)
+    {
+        if (!argv[1] || !argv[2] || parse_size (argv[1], &wstatus) < 0)
+        {
+            fprintf (stderr, "pipebuf: usage: pipebuf size cmd | ...\n");
+            return 1;
+        }
+        return start_cmd (argv[2], argv + 2, options, notify, plan);
+    }
 
-    /* Set flags */
-    if (e->type == REDIRECTION_A)
-        flags = (flags & ~O_TRUNC) | O_APPEND;
-    if (e->type == REDIRECTION_I)
-        flags = O_IN;
+    /* "on" places the command, only possible with fork */
+    if (strcmp (cmd, "on") == 0)
+        return start_placed (argv, options, notify, plan);
 
-    /* Open file for redirection */
-    if ((fd = open (*e->arguments, flags, S_MODE)) == -1)
-        goto err;
+    /* "timeout" gives a deadline to the job */
+    if (strcmp (cmd, "timeout") == 0)
+        return start_timed (argv, options, notify, plan);
 
-    /* Set redirection for next command */
-    switch (e->type)
-    {
-        case REDIRECTION_I:
-            if (dup2 (fd, STDIN_FILENO) == -1)
-                goto err2;
-            break;
+    /* "NAME=value" sets variables, only for the command if one follows */
+    if (is_assignment (cmd))
+        return start_assigned (argv, options, notify, plan);
 
-        case REDIRECTION_E:
-            if (dup2 (fd, STDERR_FILENO) == -1)
-                goto err2;
-            break;
+    /* Commands see the variables exported before them */
+    env_envp ();
 
-        case REDIRECTION_EO:
-            if (dup2 (fd, STDERR_FILENO) == -1)
-                goto err2;
-        case REDIRECTION_A:
-        case REDIRECTION_O:
-            if (dup2 (fd, STDOUT_FILENO) == -1)
-                goto err2;
-            break;
-    }
+    /* Check if the command is an internal one */
+    if (plan && find_builtin (cmd))
+        return redirect_internal (cmd, argv, plan);
+    if (!plan && (wstatus = internal_cmd (cmd, argv)) != -1)
+        return wstatus;
 
-    /* Launch next command */
-    wstatus = expression_handler (e->gauche, options, 0);
+    /* Resolve in parent, the child cannot fill the table */
+    const char* path = hash_lookup (cmd);
 
-    if (dup2 (in, STDIN_FILENO) == -1 || close (in) == -1)
-        goto err2;
-    if (dup2 (out, STDOUT_FILENO) == -1 || close (out) == -1)
-        goto err3;
-    if (dup2 (err, STDERR_FILENO) == -1 || close (err) == -1)
-        goto err4;
-    if (close (fd) == -1)
-        goto err;
+    /* Output of internal commands comes first, even if stdout is a file */
+    fflush (stdout);
 
-    return wstatus;
+    /* Nothing follows in this process, the command takes its place; a
+     * deadline needs the shell to watch it */
+    if (tail_exec && options == JFG && !deadline_cur)
+    {
+        register_signals (&sigdfl);
+        if (placement_cur && placement_apply (placement_cur) < 0)
+            exit (1);
+        if (plan && apply_plan (plan) < 0)
+            exit (1);
+        exec_cmd (path, cmd, argv);
+    }
 
-err4:
-    close (out);
-err3:
-    close (in);
-err2:
-    close (fd);
-err:
-    fprintf (stderr, "%s: %s\n", *e->arguments, strerror (errno));
-    return -1;
-}
+    /* Through the fork server if enabled, anything it cannot do, as a
+     * script without shebang, is done below */
+    if ((path || strchr (cmd, '/')) && shopt.forkserver && !placement_cur)
+        pid = server_cmd (path ? path : cmd, argv, plan);
 
-/********************
- * Command handling *
- ********************/
+    /* Spawn if we know what to execute */
+    if (pid < 0 && !placement_cur && (path || strchr (cmd, '/'))
+        && (!plan || plan_actions (plan, &actions) == 0))
+    {
+        pid = spawn_cmd (path ? path : cmd, argv, plan ? &actions : NULL);
+        if (plan)
+            posix_spawn_file_actions_destroy (&actions);
+    }
 
-/* Start a sequence */
-static int
-start_sequence (const Expression* e, int options, int notify)
-{
-    /* Create a job if it's a background sequence */
-    if (options == JBG)
+    /* Otherwise fork, execvp knows how to report errors and to run scripts
+     * without a shebang, a failed redirection is reported by the child */
+    if (pid < 0)
+        pid = fork ();
+    if (pid < 0)
     {
-        pid_t pid = fork ();
-        if (pid < 0)
-            perror ("Unable to fork");
+        perror ("Unable to fork");
+        return INTERNSTATUS + 1;
+    }
+    if (!pid)
+    {
+        /* Re-register default signal actions */
+        register_signals (&sigdfl);
 
-        if (!pid)
-        {
-            register_signals (&sigdfl);
-            if (setpgid (0, 0) < 0)
-                perror ("Unable to get pgid");
-            int wstatus = start_sequence (e, JFG, notify);
-            STATUS (wstatus);
-            exit (wstatus);
-        }
+        /* Set it in its own group */
+        if (!subshell && setpgid (0, 0) < 0)
+            perror ("Unable to get its own group");
 
-        job_t* job = register_job (pid, pid, JBG, "Sequence");
+        if (placement_cur && placement_apply (placement_cur) < 0)
+            exit (1);
 
-        /* No more job space available */
-        if (!job)
-        {
-            fprintf (stderr,
-                     "Unable to register a new job, terminate some jobs first "
-                     "(max: %d)\n",
-                     MAXJOBS);
-            return INTERNSTATUS + 1;
-        }
+        if (plan && apply_plan (plan) < 0)
+            exit (1);
 
-        launch_job (job, notify);
-        return INTERNSTATUS;
+        exec_cmd (path, cmd, argv);
     }
 
-    int wstatus;
-
-    wstatus = expression_handler (e->gauche, options, 0);
-    STATUS (wstatus);
-
-    switch (e->type)
+    /* Register a new job */
+    job_t* job = register_job (&pid,
+                               1,
+                               subshell ? getpgrp () : pid,
+                               options,
+                               cmd,
+                               line_cur ? line_cur : job_line (NULL, argv));
+
+    /* No more memory available */
+    if (!job)
     {
-        case SEQUENCE_ET:
-            if (wstatus)
-                break;
-            wstatus = expression_handler (e->droite, options, 0);
-            break;
-
-        case SEQUENCE_OU:
-            if (!wstatus)
-                break;
-        case SEQUENCE:
-            wstatus = expression_handler (e->droite, options, 0);
+        perror ("Unable to register a new job");
+        return INTERNSTATUS + 1;
     }
 
-    /* Convert status to correct one */
-    STATUS (wstatus);
+    /* launch the job */
+    launch_job (job, notify);
 
-    return wstatus;
+    /* If job is in foreground wait and return exit status */
+    if (options == JFG)
+        return JOB_STATUS (job);
+    else
+        return INTERNSTATUS;
 }
 
-/* Internal commands "fg" and "bg" */
+/* Parse "on key=value ...", returns the index of the command or -1 */
 static int
-cmd_jobctrl (char* job_cmd, int bg)
+parse_placement (char** argv, placement_t* p)
 {
-    job_t* tmp;
+    int i, r = 0;
 
-    /* Find by name */
-    if (job_cmd)
+    for (i = 1; argv[i] && (r = placement_parse (p, argv[i])) == 0; ++i)
+        ;
+    if (r < 0)
     {
-        for (int i = 0; i < MAXJOBS; ++i)
-            if (strcmp (job_list[i].cmd, job_cmd) == 0 && job_list[i].pid != 0
-                && job_list[i].pid != 0)
-            {
-                tmp = &job_list[i];
-
-                if (bg == JBG && tmp->state == JRUNNING)
-                {
-                    fprintf (
-                        stderr, "%s: job already in background\n", tmp->cmd);
-                    return 1;
-                }
-
-                fprintf (stdout, "[%d]+ Resumed\t%s\n", tmp->jid, tmp->cmd);
-
-                if (bg == JBG)
-                    send_to_background (tmp);
-                else
-                    send_to_foreground (tmp);
-
-                return 0;
-            }
-
-        fprintf (stderr,
-                 "%s: job not found: %s\n",
-                 bg == JBG ? "bg" : "fg",
-                 job_cmd);
+        fprintf (stderr, "on: invalid placement: %s\n", argv[i]);
+        return -1;
+    }
+    return i;
+}
 
-        return 1;
+/* Launch "on key=value ... cmd", or change the defaults without cmd */
+static int
+start_placed (char** argv, int options, int notify, const redir_plan_t* plan)
+{
+    static char* cgroup = NULL;
+    const placement_t* saved = placement_cur;
+    placement_t p            = placement_default;
+    placement_t given        = {0};
+    char buf[256];
+    int wstatus, i;
+
+    /* "on -r" forgets the defaults, "on" alone shows them */
+    if (argv[1] && strcmp (argv[1], "-r") == 0 && !argv[2])
+    {
+        memset (&placement_default, 0, sizeof placement_default);
+        placement_cur = NULL;
+        return 0;
+    }
+    if (!argv[1])
+    {
+        placement_describe (&placement_default, buf, sizeof buf);
+        fprintf (stdout, "%s\n", *buf ? buf : "default");
+        return 0;
     }
 
-    /* Find by last job */
+    if ((i = parse_placement (argv, &given)) < 0)
+        return 1;
+    placement_merge (&p, &given);
 
-    /* Find any job if there are none in last_job or it's already done*/
-    if (!last_job || last_job->state == JDONE)
+    /* New defaults, they outlive the line */
+    if (!argv[i])
     {
-        for (int i = 0; i < MAXJOBS; ++i)
+        if (p.cgroup && p.cgroup != placement_default.cgroup)
         {
-            if (job_list[i].pid != 0 && job_list[i].state != JDONE)
+            free (cgroup);
+            if ((p.cgroup = cgroup = strdup (p.cgroup)) == NULL)
             {
-                last_job = &job_list[i];
-                break;
+                perror ("on");
+                return 1;
             }
         }
-        /* No jobs to be fg'd */
-        if (!last_job || last_job->state == JDONE)
-        {
-            fprintf (stderr, "%s: no job to resume\n", bg ? "bg" : "fg");
-            return 1;
-        }
+        placement_default = p;
+        placement_cur     = &placement_default;
+        return 0;
     }
 
-    tmp = last_job;
+    placement_cur = &p;
+    wstatus       = start_cmd (argv[i], argv + i, options, notify, plan);
+    placement_cur = saved;
+    return wstatus;
+}
+
+/* Parse "secs[smhd]" into the deadline it gives from now, -1 if invalid */
+static int
+parse_deadline (const char* str, struct timespec* deadline)
+{
+    double secs;
+    char* end;
 
-    /* Check if there is not a more recent job (pid higher) */
-    for (int i = 0; i < MAXJOBS; ++i)
-        if (job_list[i].pid != 0 && job_list[i].state != JDONE
-            && job_list[i].pid >= tmp->pid)
-            tmp = &job_list[i];
+    secs = strtod (str, &end);
+    if (end == str)
+        return -1;
 
-    if (bg == JBG && tmp->state == JRUNNING)
+    switch (*end)
     {
-        fprintf (stderr, "%s: job already in background\n", tmp->cmd);
-        return 1;
+        case 'd':
+            secs *= 24 * 60 * 60;
+            ++end;
+            break;
+        case 'h':
+            secs *= 60 * 60;
+            ++end;
+            break;
+        case 'm':
+            secs *= 60;
+            ++end;
+            break;
+        case 's':
+            ++end;
+            break;
     }
 
-    fprintf (stdout, "[%d]+ Resumed\t%s\n", tmp->jid, tmp->cmd);
-    if (bg == JBG)
-        send_to_background (tmp);
-    else
-        send_to_foreground (tmp);
+    /* NaN fails every comparison, it must not reach the casts */
+    if (*end || !(secs >= 0) || !isfinite (secs) || secs > INT_MAX)
+        return -1;
 
+    clock_gettime (CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += (time_t) secs;
+    deadline->tv_nsec += (long) ((secs - (time_t) secs) * 1e9);
+    if (deadline->tv_nsec >= 1000000000)
+    {
+        deadline->tv_nsec -= 1000000000;
+        ++deadline->tv_sec;
+    }
     return 0;
 }
 
-/* Handles internal commands */
+/* Launch "timeout secs cmd" */
 static int
-internal_cmd (char* cmd, char** argv)
+start_timed (char** argv, int options, int notify, const redir_plan_t* plan)
 {
-    char* arg;
-    switch (hash_cmd (cmd))
+    const struct timespec* saved = deadline_cur;
+    struct timespec deadline;
+    int wstatus;
+
+    if (!argv[1] || !argv[2] || parse_deadline (argv[1], &deadline) < 0)
     {
-        /* Exit terminal */
-        case EXIT:
-            EndOfFile ();
-            return 0;
+        fprintf (stderr, "timeout: usage: timeout secs[smhd] cmd\n");
+        return 1;
+    }
 
-        /* Print its arguments or last exit code */
-        case ECHO:
-            if (argv[1] == NULL)
-                return 0;
-            if (hash_cmd (*(argv + 1)) == ECHO_STATUS)
-            {
-                printf ("%d ", laststatus);
-                ++argv;
-            }
-            while ((arg = *++argv))
-            {
-                printf ("%s", arg);
-                if (*(argv + 1))
-                    printf (" ");
-            }
-            printf ("\n");
-            return 0;
+    deadline_cur = &deadline;
+    wstatus      = start_cmd (argv[2], argv + 2, options, notify, plan);
+    deadline_cur = saved;
+    return wstatus;
+}
 
-        /* Change working directory */
-        case CD:
-            /* TODO: if no argument go to ~ */
-            if (argv[1] == NULL)
-                return 0;
-            if (chdir (*(argv + 1)) == 0)
-                return 0;
-            fprintf (stderr,
-                     "Unable to change directory: %s (%s)\n",
-                     strerror (errno),
-                     *argv + 1);
-            return 1;
+/***********************
+ * Expression handling *
+ ***********************/
 
-        /* Display help */
-        case HELP:
-            dipslay_help ();
-            return 0;
+/* Emit an instruction, the array grows as needed */
+static op_t*
+emit (program_t** p, int* cap, int code, const Expression* e)
+{
+    if ((*p)->n == *cap)
+    {
+        program_t* q = realloc (*p, sizeof **p + 2 * *cap * sizeof *q->ops);
+        if (!q)
+            return NULL;
+        *p = q;
+        *cap *= 2;
+    }
+    (*p)->ops[(*p)->n].code   = code;
+    (*p)->ops[(*p)->n].target = 0;
+    (*p)->ops[(*p)->n].e      = e;
+    return &(*p)->ops[(*p)->n++];
+}
 
-        /* Print a "hash" */
-        case HASH:
-            if (argv[1] == NULL)
-            {
-                fprintf (stderr, "hash: no argument to hash\n");
-                return 1;
-            }
-            printf ("%x\n", hash_cmd (argv[1]));
-            return 0;
+/* Lower the sequences of an expression, the tree is walked with an explicit
+ * stack: a script of thousands of "a; b; ..." is as deep as it is long */
+static program_t*
+compile_program (const Expression* e)
+{
+    /* A node being lowered, state is the number of its children done */
+    typedef struct frame
+    {
+        const Expression* e;
+        int state;
+        int jump;
+    } frame_t;
+
+    int cap        = 16;
+    int depth      = 1;
+    int size       = 16;
+    program_t* p   = malloc (sizeof *p + cap * sizeof *p->ops);
+    frame_t* stack = malloc (size * sizeof *stack);
+    op_t* op;
+
+    if (!p || !stack)
+        goto err;
 
-        /* List all jobs */
-        case JOBS:
-            for (int i = 0; i < MAXJOBS; ++i)
-                if (job_list[i].pid != 0)
-                    display_job (&job_list[i]);
-            return 0;
+    p->n     = 0;
+    stack[0] = (frame_t){e, 0, -1};
+    while (depth)
+    {
+        frame_t* f = &stack[depth - 1];
+        const Expression* child;
+        int code;
+
+        switch (f->e->type)
+        {
+            case SEQUENCE:
+            case SEQUENCE_ET:
+            case SEQUENCE_OU:
+                /* Left, then the jump over the right, then right */
+                if (f->state == 2)
+                {
+                    if (f->jump >= 0)
+                        p->ops[f->jump].target = p->n;
+                    --depth;
+                    continue;
+                }
+                if (f->state++ == 1 && f->e->type != SEQUENCE)
+                {
+                    if (!(op = emit (&p,
+                                     &cap,
+                                     f->e->type == SEQUENCE_ET ? OP_IF_FAIL
+                                                               : OP_IF_OK,
+                                     f->e)))
+                        goto err;
+                    f->jump = op - p->ops;
+                }
+                child = f->state == 1 ? f->e->gauche : f->e->droite;
+
+                if (depth == size)
+                {
+                    frame_t* s = realloc (stack, 2 * size * sizeof *stack);
+                    if (!s)
+                        goto err;
+                    stack = s;
+                    size *= 2;
+                }
+                stack[depth++] = (frame_t){child, 0, -1};
+                continue;
+
+            case VIDE:
+                --depth;
+                continue;
+            case SIMPLE:
+                code  = OP_SPAWN;
+                child = f->e;
+                break;
+            case PIPE:
+                code  = OP_PIPE;
+                child = f->e;
+                break;
+            case BG:
+                code  = OP_BG;
+                child = f->e->gauche;
+                break;
+            case CHRONO:
+                code  = OP_TIME;
+                child = f->e->gauche;
+                break;
+            default:
+                code  = OP_REDIRECT;
+                child = f->e;
+        }
 
-        /* Send to foreground */
-        case CFG:
-            return cmd_jobctrl (argv[1], JFG);
-        /* Send to background */
-        case CBG:
-            return cmd_jobctrl (argv[1], JBG);
+        if (!emit (&p, &cap, code, child))
+            goto err;
+        --depth;
     }
 
-    /* No internal command foun */
-    return -1;
+    free (stack);
+    return p;
+
+err:
+    free (stack);
+    free (p);
+    return NULL;
 }
 
-/* Start the command accordingly */
+/* Run a program, as start_sequence did by recursion */
 static int
-start_cmd (char* cmd, char** argv, int options, int notify)
+run_program (const program_t* p, int notify)
 {
-    int wstatus;
+    int wstatus = INTERNSTATUS;
+    int tail    = tail_exec;
+    char** argv;
 
-    /* Check if the command is an internal one */
-    wstatus = internal_cmd (cmd, argv);
-    if (wstatus != -1)
-        return wstatus;
+    /* Commands of a sequence are not notified, as jobs of their own */
+    if (p->n > 1)
+        notify = 0;
 
-    pid_t pid = fork ();
-    if (!pid)
+    for (int pc = 0; pc < p->n; ++pc)
     {
-        /* Re-register default signal actions */
-        register_signals (&sigdfl);
+        const op_t* op = &p->ops[pc];
 
-        /* Set it in its own group */
-        if (setpgid (0, 0) < 0)
-            perror ("Unable to get its own group");
+        /* Jumps only go forward, nothing runs after the last operation */
+        tail_exec = tail && pc == p->n - 1;
+
+        switch (op->code)
+        {
+            case OP_SPAWN:
+                argv    = expand_arguments (op->e->arguments);
+                wstatus = start_cmd (*argv, argv, JFG, notify, NULL);
+                break;
+            case OP_PIPE:
+                wstatus = lay_pipeline (op->e, JFG, notify);
+                break;
+            case OP_REDIRECT:
+                wstatus = lay_redirection (op->e, JFG, notify);
+                break;
+            case OP_BG:
+                wstatus = expression_handler (op->e, JBG, notify);
+                break;
+            case OP_TIME:
+                wstatus = time_expression (op->e, JFG, notify);
+                break;
 
-        execvp (cmd, argv);
+            /* The status is already converted */
+            case OP_IF_OK:
+                if (!wstatus)
+                    pc = op->target - 1;
+                continue;
+            case OP_IF_FAIL:
+                if (wstatus)
+                    pc = op->target - 1;
+                continue;
+        }
 
-        fprintf (stderr, "%s: command not found\n", cmd);
-        exit (1);
+        STATUS (wstatus);
     }
 
-    /* Register a new job */
-    job_t* job = register_job (pid, pid, options, cmd);
+    STATUS (wstatus);
+    return wstatus;
+}
 
-    /* No more job space available */
-    if (!job)
+/* Run an expression in the foreground */
+static int
+run_expression (const Expression* e, int notify)
+{
+    program_t* p = cache_data (e);
+    int wstatus, attached;
+
+    if (p)
+        return run_program (p, notify);
+
+    if (!(p = compile_program (e)))
     {
-        fprintf (stderr,
-                 "Unable to register a new job, terminate some jobs first "
-                 "(max: %d)\n",
-                 MAXJOBS);
+        perror ("Unable to compile the line");
         return INTERNSTATUS + 1;
     }
 
-    /* launch the job */
-    launch_job (job, notify);
-
-    /* If job is in foreground wait and return exit status */
-    if (options == JFG)
-        return job->status;
-    else
-        return INTERNSTATUS;
+    /* Kept with the tree if it is cached, the line may come again */
+    attached = cache_attach (e, p) == 0;
+    wstatus  = run_program (p, notify);
+    if (!attached)
+        free (p);
+    return wstatus;
 }
 
-/***********************
- * Expression handling *
- ***********************/
-
 /* Handle the expression */
 static int
 expression_handler (const Expression* e, int options, int notify)
@@ -1023,7 +4743,7 @@ expression_handler (const Expression* e, int options, int notify)
     int wstatus;
 
     if (e->type >= REDIRECTION_I)
-        return lay_redirection (e, options);
+        return lay_redirection (e, options, notify);
 
     switch (e->type)
     {
@@ -1035,11 +4755,16 @@ expression_handler (const Expression* e, int options, int notify)
         case SEQUENCE_OU:
             return start_sequence (e, options, notify);
         case PIPE:
-            return lay_pipeline (e, options);
+            return lay_pipeline (e, options, notify);
         case BG:
             return expression_handler (e->gauche, JBG, notify);
+        case CHRONO:
+            return time_expression (e->gauche, options, notify);
         case SIMPLE:
-            return start_cmd (*e->arguments, e->arguments, options, notify);
+        {
+            char** argv = expand_arguments (e->arguments);
+            return start_cmd (*argv, argv, options, notify, NULL);
+        }
     }
 
     /* Unexpected */
@@ -1047,6 +4772,45 @@ expression_handler (const Expression* e, int options, int notify)
     return INTERNSTATUS + 1;
 }
 
+/* Run an expression and display times of everything it waited for */
+static int
+time_expression (const Expression* e, int options, int notify)
+{
+    struct rusage* outer = timed_usage;
+    struct rusage usage;
+    struct timespec start, end;
+    int wstatus;
+
+    /* Nothing is waited in background, see "jobs -l" */
+    if (options == JBG)
+        return expression_handler (e, options, notify);
+
+    /* Times are displayed after it, it can't replace the process */
+    memset (&usage, 0, sizeof usage);
+    timed_usage = &usage;
+    tail_exec   = 0;
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    wstatus = expression_handler (e, options, notify);
+    clock_gettime (CLOCK_MONOTONIC, &end);
+
+    /* A "time" inside another one */
+    timed_usage = outer;
+    if (outer)
+        add_usage (outer, &usage);
+
+    /* After what was timed */
+    fflush (stdout);
+    fprintf (stderr,
+             "real\t%.3fs\nuser\t%.3fs\nsys\t%.3fs\nmaxrss\t%ldKB\n",
+             elapsed (&start, &end),
+             seconds (&usage.ru_utime),
+             seconds (&usage.ru_stime),
+             usage.ru_maxrss);
+
+    return wstatus;
+}
+
 /* Entry Point */
 int
 evaluer_expr (Expression* e)
@@ -1065,9 +4829,14 @@ evaluer_expr (Expression* e)
         if (init_shell () < 0)
             longjmp (env, r + 1);
 
+    /* Listings read for previous lines are checked again */
+    glob_new_line ();
+
     /* Always foreground by default */
     /* If interactive, then notify for jobs */
-    int wstatus = expression_handler (e, JFG, interactive);
+    /* The last line of a script or of -c may end with an exec */
+    tail_exec   = !interactive && DerniereLigne ();
+    int wstatus = run_expression (e, interactive);
 
     /* Reap old jobs */
     grim_reaper ();
@@ -1076,8 +4845,8 @@ evaluer_expr (Expression* e)
     STATUS (wstatus);
 
     /* If the last foreground job had an error, prioritize it */
-    if (fg_job && fg_job->status != 0)
-        wstatus = fg_job->status;
+    if (fg_job && JOB_STATUS (fg_job) != 0)
+        wstatus = JOB_STATUS (fg_job);
 
     /* Update laststatus for %? */
     laststatus = wstatus;
@@ -1087,11 +4856,15 @@ evaluer_expr (Expression* e)
         switch (fg_job->termsig)
         {
             case SIGSEGV:
-                fprintf (stderr, "%s: Segmentation fault.\n", fg_job->cmd);
+                fprintf (stderr,
+                         "%s: Segmentation fault.\n",
+                         pool_string (fg_job->name));
                 break;
             case SIGKILL:
             case SIGTERM:
-                fprintf (stderr, "%s: Terminated.\n", fg_job->cmd);
+                fprintf (stderr,
+                         "%s: Terminated.\n",
+                         pool_string (fg_job->name));
                 break;
         }
 
@@ -4,5 +4,7 @@
 #include "Shell.h"
 
 extern int evaluer_expr (Expression* e);
+/* Name of the i-th internal command, NULL past the last one */
+extern const char* builtin_name (size_t i);
 
 #endif
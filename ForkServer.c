@@ -0,0 +1,610 @@
+/*
+    Fork server
+    ===========
+
+    posix_spawn does not copy the shell's memory, but the new process still
+    starts from the shell: its mappings, fd table and signal state grow with
+    readline, the history and the job table. Here a helper is forked while
+    the shell is still small and launches commands on request. The shell
+    sends it a path, argv, the environment changed since the helper was
+    started and the fds of the command over a UNIX socket (SCM_RIGHTS), the
+    helper forks and execs, then replies with the pid.
+
+    The helper forks an intermediate process which spawns the command and
+    exits at once, so the command is reparented to the shell, its
+    subreaper. It is then waited for, stopped and resumed as any other child
+    and keeps its place in the job table.
+
+    Subreapers only exist on Linux, elsewhere the server never starts.
+*/
+
+#include "ForkServer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+extern char** environ;
+
+/* Fds sent with a request: current directory, stdin, stdout, stderr */
+#define FDS_MAX 4
+/* Highest fd closed by the server when it starts */
+#define FDS_CLOSED 1024
+
+/* Header of a request, followed by len bytes of strings:
+ * path, argv, names to unset, then "NAME=value" to set */
+typedef struct request
+{
+    pid_t pgid; /* Group to join, 0 for its own */
+    int closed; /* Bit n set if fd n must be closed */
+    int argc;   /* Number of arguments */
+    int unsetc; /* Number of variables removed */
+    int setc;   /* Number of variables added or changed */
+    size_t len; /* Bytes of strings */
+} request_t;
+
+typedef struct reply
+{
+    pid_t pid; /* Pid of the command, -1 if not forked */
+    int err;   /* errno of fork or execve, 0 if executed */
+} reply_t;
+
+/* Our end of the socket, -1 if not running */
+static int server_fd = -1;
+/* Pid of the server */
+static pid_t server_pid = -1;
+/* Process which started it, a forked subshell cannot use it */
+static pid_t owner = -1;
+/* Environment of the server, the delta is sent with each request */
+/* Copied with its strings, the shell frees those it replaces */
+static char** env_snapshot = NULL;
+
+/* Signals the shell handles, reset for the server and its commands */
+static const int signals[]
+    = {SIGCHLD, SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGPIPE, -1};
+
+/* Read exactly len bytes, -1 on error or end of file */
+static int
+read_all (int fd, void* buf, size_t len)
+{
+    char* p = buf;
+    ssize_t n;
+
+    while (len)
+    {
+        if ((n = read (fd, p, len)) < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Write exactly len bytes on a socket, never raises SIGPIPE */
+static int
+send_all (int fd, const void* buf, size_t len)
+{
+    const char* p = buf;
+    ssize_t n;
+
+    while (len)
+    {
+        if ((n = send (fd, p, len, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*****************
+ * Server's side *
+ *****************/
+
+/* Receive the header of a request and its fds */
+static int
+recv_request (int sock, request_t* req, int* fds, int* nfds)
+{
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE (FDS_MAX * sizeof (int))];
+    } ctl;
+    struct iovec iov    = {req, sizeof *req};
+    struct msghdr msg   = {0};
+    struct cmsghdr* cmsg;
+    ssize_t n;
+
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctl.buf;
+    msg.msg_controllen = sizeof ctl.buf;
+
+    while ((n = recvmsg (sock, &msg, 0)) < 0 && errno == EINTR)
+        ;
+    if (n <= 0)
+        return -1;
+
+    *nfds = 0;
+    for (cmsg = CMSG_FIRSTHDR (&msg); cmsg; cmsg = CMSG_NXTHDR (&msg, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            *nfds = (cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+            memcpy (fds, CMSG_DATA (cmsg), *nfds * sizeof (int));
+        }
+
+    /* Commands only get them as 0-2 */
+    for (int i = 0; i < *nfds; ++i)
+        fcntl (fds[i], F_SETFD, FD_CLOEXEC);
+
+    /* A stream socket may cut the header */
+    if ((size_t) n < sizeof *req
+        && read_all (sock, (char*) req + n, sizeof *req - n) < 0)
+        return -1;
+    return 0;
+}
+
+/* Next string of a request */
+static char*
+next_string (char** s)
+{
+    char* str = *s;
+    *s += strlen (str) + 1;
+    return str;
+}
+
+/* Intermediate process of a request, writes a reply_t on report */
+static void
+fork_request (const request_t* req,
+              char* strings,
+              const int* fds,
+              int report)
+{
+    char** argv   = malloc ((req->argc + 1) * sizeof *argv);
+    char* s       = strings;
+    reply_t reply = {-1, 0};
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    int i, k;
+
+    if (!argv)
+    {
+        reply.err = ENOMEM;
+        goto end;
+    }
+
+    /* Path, arguments, then the environment: removed first, a changed
+     * variable is removed then set */
+    next_string (&s);
+    for (i = 0; i < req->argc; ++i)
+        argv[i] = next_string (&s);
+    argv[i] = NULL;
+    for (i = 0; i < req->unsetc; ++i)
+        unsetenv (next_string (&s));
+    for (i = 0; i < req->setc; ++i)
+        putenv (next_string (&s));
+
+    /* Same directory as the shell */
+    if (fchdir (fds[0]) < 0)
+    {
+        reply.err = errno;
+        goto end;
+    }
+
+    /* fds[0] is the directory, received fds are above 2 as the server's 0-2
+     * are always open, and all of them are closed on exec */
+    if ((reply.err = posix_spawn_file_actions_init (&actions)) != 0
+        || (reply.err = posix_spawnattr_init (&attr)) != 0)
+        goto end;
+    for (i = 0, k = 1; i < 3 && !reply.err; ++i)
+        if (req->closed & (1 << i))
+            reply.err = posix_spawn_file_actions_addclose (&actions, i);
+        else
+            reply.err
+                = posix_spawn_file_actions_adddup2 (&actions, fds[k++], i);
+
+    /* posix_spawn reports a failed execve */
+    if (!reply.err
+        && (reply.err = posix_spawnattr_setpgroup (&attr, req->pgid)) == 0
+        && (reply.err = posix_spawnattr_setflags (&attr, POSIX_SPAWN_SETPGROUP))
+               == 0)
+        reply.err = posix_spawn (&reply.pid, strings, &actions, &attr, argv,
+                                 environ);
+
+end:
+    while (write (report, &reply, sizeof reply) < 0 && errno == EINTR)
+        ;
+    _exit (0);
+}
+
+/* Number of strings in a buffer, each terminated by '\0' */
+static int
+count_strings (const char* s, size_t len)
+{
+    int n = 0;
+
+    if (len && s[len - 1] != '\0')
+        return -1;
+    while (len--)
+        if (*s++ == '\0')
+            ++n;
+    return n;
+}
+
+/* Launch a command, replies once it is executed and reparented to us */
+static void
+serve_request (int sock,
+               const request_t* req,
+               char* strings,
+               const int* fds,
+               int nfds)
+{
+    reply_t reply = {-1, EINVAL};
+    int expected  = 1;
+    int report[2];
+    pid_t pid;
+
+    for (int i = 0; i < 3; ++i)
+        if (!(req->closed & (1 << i)))
+            ++expected;
+
+    if (nfds != expected
+        || count_strings (strings, req->len)
+               != 1 + req->argc + req->unsetc + req->setc)
+        goto send;
+
+    if (pipe (report) < 0)
+    {
+        reply.err = errno;
+        goto send;
+    }
+    fcntl (report[0], F_SETFD, FD_CLOEXEC);
+    fcntl (report[1], F_SETFD, FD_CLOEXEC);
+
+    if ((pid = fork ()) == 0)
+    {
+        close (report[0]);
+        fork_request (req, strings, fds, report[1]);
+    }
+    close (report[1]);
+
+    if (pid < 0)
+        reply.err = errno;
+    else
+    {
+        if (read_all (report[0], &reply, sizeof reply) < 0)
+        {
+            reply.pid = -1;
+            reply.err = ECHILD;
+        }
+        /* Once it is reaped the command is the shell's child */
+        while (waitpid (pid, NULL, 0) < 0 && errno == EINTR)
+            ;
+    }
+    close (report[0]);
+
+send:
+    send_all (sock, &reply, sizeof reply);
+}
+
+/* Main loop of the server, exits when the shell closes the socket */
+static void
+serve (int sock)
+{
+    char* strings = NULL;
+    size_t cap    = 0;
+    request_t req;
+    int fds[FDS_MAX];
+    int nfds;
+
+    while (recv_request (sock, &req, fds, &nfds) == 0)
+    {
+        if (req.len > cap)
+        {
+            free (strings);
+            if ((strings = malloc (cap = req.len)) == NULL)
+                break;
+        }
+        if (read_all (sock, strings, req.len) < 0)
+            break;
+
+        serve_request (sock, &req, strings, fds, nfds);
+
+        for (int i = 0; i < nfds; ++i)
+            close (fds[i]);
+    }
+
+    _exit (0);
+}
+
+/* Start as a server, in a fresh state */
+static void
+become_server (int sock)
+{
+    struct sigaction dfl;
+    sigset_t none;
+    int fd;
+
+    /* Out of the terminal's group, ^C is not for us */
+    setpgid (0, 0);
+
+    /* Handlers are reset by execve, not ignored signals nor the mask */
+    memset (&dfl, 0, sizeof dfl);
+    dfl.sa_handler = SIG_DFL;
+    sigemptyset (&dfl.sa_mask);
+    for (const int* s = signals; *s != -1; ++s)
+        sigaction (*s, &dfl, NULL);
+    sigemptyset (&none);
+    sigprocmask (SIG_SETMASK, &none, NULL);
+
+    /* Only the socket is kept, on fd 3, and 0-2 are /dev/null so that
+     * received fds are always above */
+    if (sock != 3)
+    {
+        dup2 (sock, 3);
+        close (sock);
+    }
+    fcntl (3, F_SETFD, FD_CLOEXEC);
+    for (fd = 4; fd < FDS_CLOSED; ++fd)
+        close (fd);
+    if ((fd = open ("/dev/null", O_RDWR)) >= 0)
+    {
+        for (int i = 0; i < 3; ++i)
+            if (fd != i)
+                dup2 (fd, i);
+        if (fd > 2)
+            close (fd);
+    }
+
+    serve (3);
+}
+
+/****************
+ * Shell's side *
+ ****************/
+
+/* Start the server, -1 if unsupported or on error */
+int
+forkserver_start (void)
+{
+#ifdef PR_SET_CHILD_SUBREAPER
+    int sv[2];
+    size_t n, size;
+    char* strings;
+    pid_t pid;
+
+    if (forkserver_running ())
+        return 0;
+
+    /* Orphans of our descendants, as the commands launched, become ours */
+    if (prctl (PR_SET_CHILD_SUBREAPER, 1) < 0)
+        return -1;
+    if (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        return -1;
+
+    /* Remember the environment given to the server, in one block */
+    for (n = 0, size = 0; environ[n]; ++n)
+        size += strlen (environ[n]) + 1;
+    free (env_snapshot);
+    size += (n + 1) * sizeof *env_snapshot;
+    if ((env_snapshot = malloc (size)) == NULL)
+        goto err;
+    strings = (char*) (env_snapshot + n + 1);
+    for (n = 0; environ[n]; ++n)
+    {
+        env_snapshot[n] = strcpy (strings, environ[n]);
+        strings += strlen (strings) + 1;
+    }
+    env_snapshot[n] = NULL;
+
+    if ((pid = fork ()) < 0)
+        goto err;
+    if (pid == 0)
+    {
+        close (sv[0]);
+        become_server (sv[1]);
+    }
+
+    close (sv[1]);
+    fcntl (sv[0], F_SETFD, FD_CLOEXEC);
+    server_fd  = sv[0];
+    server_pid = pid;
+    owner      = getpid ();
+    return 0;
+
+err:
+    close (sv[0]);
+    close (sv[1]);
+    return -1;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* Stop the server, commands are spawned by the shell again */
+void
+forkserver_stop (void)
+{
+    if (server_fd < 0)
+        return;
+
+    close (server_fd);
+    server_fd = -1;
+    if (owner != getpid ())
+        return;
+
+    /* It exits on end of file, it may already be reaped */
+    while (waitpid (server_pid, NULL, 0) < 0 && errno == EINTR)
+        ;
+#ifdef PR_SET_CHILD_SUBREAPER
+    prctl (PR_SET_CHILD_SUBREAPER, 0);
+#endif
+}
+
+/* Non zero if commands of this process may be launched by the server */
+int
+forkserver_running (void)
+{
+    return server_fd >= 0 && owner == getpid ();
+}
+
+/* Append a string to the buffer of a request */
+static int
+append (char** buf, size_t* cap, size_t* len, const char* s, size_t n)
+{
+    if (*len + n + 1 > *cap)
+    {
+        size_t size = *cap ? *cap : 4096;
+        char* p;
+
+        while (*len + n + 1 > size)
+            size *= 2;
+        if ((p = realloc (*buf, size)) == NULL)
+            return -1;
+        *buf = p;
+        *cap = size;
+    }
+
+    memcpy (*buf + *len, s, n);
+    (*buf)[*len + n] = '\0';
+    *len += n + 1;
+    return 0;
+}
+
+/* Non zero if s is one of the strings of env */
+static int
+in_env (char* const* env, const char* s)
+{
+    for (; *env; ++env)
+        if (strcmp (*env, s) == 0)
+            return 1;
+    return 0;
+}
+
+/* Launch a command through the server, returns its pid or -1 */
+pid_t
+forkserver_spawn (const char* path,
+                  char* const argv[],
+                  char* const envp[],
+                  const int fds[3],
+                  pid_t pgid)
+{
+    static char* buf = NULL;
+    static size_t cap = 0;
+    size_t len        = 0;
+    request_t req     = {pgid, 0, 0, 0, 0, 0};
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE (FDS_MAX * sizeof (int))];
+    } ctl;
+    struct iovec iov  = {&req, sizeof req};
+    struct msghdr msg = {0};
+    struct cmsghdr* cmsg;
+    int sent[FDS_MAX];
+    int nfds = 0;
+    reply_t reply;
+    size_t same;
+    int i;
+
+    if (!forkserver_running ())
+    {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    /* Strings: path and arguments */
+    if (append (&buf, &cap, &len, path, strlen (path)) < 0)
+        return -1;
+    for (req.argc = 0; argv[req.argc]; ++req.argc)
+        if (append (&buf, &cap, &len, argv[req.argc], strlen (argv[req.argc]))
+            < 0)
+            return -1;
+
+    /* Then the environment changed since the snapshot, both are usually
+     * equal from start to end */
+    for (same = 0;
+         envp[same] && env_snapshot[same]
+         && strcmp (envp[same], env_snapshot[same]) == 0;
+         ++same)
+        ;
+    for (i = same; env_snapshot[i]; ++i)
+        if (!in_env (envp + same, env_snapshot[i]))
+        {
+            if (append (&buf,
+                        &cap,
+                        &len,
+                        env_snapshot[i],
+                        strcspn (env_snapshot[i], "="))
+                < 0)
+                return -1;
+            ++req.unsetc;
+        }
+    for (i = same; envp[i]; ++i)
+        if (!in_env (env_snapshot + same, envp[i]))
+        {
+            if (append (&buf, &cap, &len, envp[i], strlen (envp[i])) < 0)
+                return -1;
+            ++req.setc;
+        }
+    req.len = len;
+
+    /* Fds: the current directory, then those of the command */
+    if ((sent[nfds++] = open (".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return -1;
+    for (i = 0; i < 3; ++i)
+        if (fds[i] < 0)
+            req.closed |= 1 << i;
+        else
+            sent[nfds++] = fds[i];
+
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctl.buf;
+    msg.msg_controllen = CMSG_SPACE (nfds * sizeof (int));
+    cmsg               = CMSG_FIRSTHDR (&msg);
+    cmsg->cmsg_level   = SOL_SOCKET;
+    cmsg->cmsg_type    = SCM_RIGHTS;
+    cmsg->cmsg_len     = CMSG_LEN (nfds * sizeof (int));
+    memcpy (CMSG_DATA (cmsg), sent, nfds * sizeof (int));
+
+    while ((i = sendmsg (server_fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+    close (sent[0]);
+
+    /* A closed fd is refused but the server is fine */
+    if (i < 0 && errno == EBADF)
+        return -1;
+
+    /* Otherwise the server is gone, stop using it */
+    if (i != sizeof req || send_all (server_fd, buf, len) < 0
+        || read_all (server_fd, &reply, sizeof reply) < 0)
+    {
+        forkserver_stop ();
+        errno = EPIPE;
+        return -1;
+    }
+
+    if (reply.pid < 0 || reply.err)
+    {
+        errno = reply.err;
+        return -1;
+    }
+    return reply.pid;
+}
@@ -0,0 +1,24 @@
+#ifndef _FORKSERVER_H
+#define _FORKSERVER_H
+
+#include <sys/types.h>
+
+/* Fork server, a small helper forked early that launches commands for us */
+/* Its commands become our children (we are their subreaper) and are waited
+ * for as any other */
+
+/* Start the server, -1 if unsupported or on error */
+extern int forkserver_start (void);
+/* Stop the server, commands are spawned by the shell again */
+extern void forkserver_stop (void);
+/* Non zero if commands of this process may be launched by the server */
+extern int forkserver_running (void);
+/* Launch path with fds[0..2] as stdin, stdout and stderr (-1 to close them),
+ * in group pgid (0 for its own), returns its pid or -1 with errno set */
+extern pid_t forkserver_spawn (const char* path,
+                               char* const argv[],
+                               char* const envp[],
+                               const int fds[3],
+                               pid_t pgid);
+
+#endif
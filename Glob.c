@@ -0,0 +1,490 @@
+/*
+    Pathname expansion
+    ==================
+
+    A pattern is split on '/'. Leading segments without wildcards are a
+    prefix and are never looked up. Every other segment is matched against
+    the listing of each directory reached so far: a wildcard segment with
+    fnmatch, or a plain compare for "*", "*.o" and "lib*", a literal segment
+    by binary search in the sorted listing. Neither costs a syscall.
+
+    Listings are read by large getdents64 batches on Linux, sorted once and
+    cached by (dev, ino, mtime). On the current line a cached listing is
+    always reused. On a later line it is reused if the directory was not
+    modified since, unless it was modified less than a second before it was
+    read: an entry added within the same tick leaves mtime unchanged.
+*/
+
+#include "Glob.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+/* Not declared with _XOPEN_SOURCE */
+extern long syscall (long number, ...);
+#endif
+
+/* Number of listings kept */
+#define GLOB_CACHE 16
+/* Bytes read by one getdents64 */
+#define GLOB_BATCH (256 * 1024)
+
+/* d_type of Linux, DT_* are not given by _XOPEN_SOURCE */
+#define TYPE_UNKNOWN 0
+#define TYPE_DIR 4
+#define TYPE_LINK 10
+
+typedef struct entry
+{
+    const char* name; /* In the block of its listing */
+    size_t len;       /* Length of name */
+    int dir;          /* 0 if surely not a directory */
+} entry_t;
+
+typedef struct listing
+{
+    dev_t dev;             /* Directory listed */
+    ino_t ino;             /* Directory listed */
+    struct timespec mtime; /* Its mtime when it was read */
+    int racy;              /* Modified as it was read, see above */
+    unsigned long line;    /* Last line it was used for */
+    entry_t* entries;      /* Sorted by name, without "." and ".." */
+    size_t n;              /* Number of entries */
+    char* block;           /* Names */
+} listing_t;
+
+/* Kinds of segments, from the cheapest to match */
+enum segment_kind
+{
+    SEG_LITERAL, /* No wildcard */
+    SEG_ALL,     /* "*" */
+    SEG_PREFIX,  /* "lit*" */
+    SEG_SUFFIX,  /* "*lit" */
+    SEG_PATTERN  /* Anything else, given to fnmatch */
+};
+
+typedef struct segment
+{
+    const char* pat; /* Segment, terminated */
+    int kind;        /* See segment_kind */
+    const char* lit; /* Literal part of SEG_PREFIX and SEG_SUFFIX */
+    size_t litlen;   /* Its length */
+} segment_t;
+
+/* Growable list of paths */
+typedef struct paths
+{
+    char** v;
+    size_t n;
+    size_t cap;
+} paths_t;
+
+/* Listings kept, replaced in turn */
+static listing_t cache[GLOB_CACHE];
+static int cache_next = 0;
+/* Current line */
+static unsigned long line = 1;
+
+/* A new line starts, listings read before may be checked again */
+void
+glob_new_line (void)
+{
+    ++line;
+}
+
+/* Order of entries */
+static int
+compare_entries (const void* a, const void* b)
+{
+    return strcmp (((const entry_t*) a)->name, ((const entry_t*) b)->name);
+}
+
+/* Order of paths */
+static int
+compare_paths (const void* a, const void* b)
+{
+    return strcmp (*(char* const*) a, *(char* const*) b);
+}
+
+/* Names being read: offsets in a block, pointers are only set at the end
+ * as the block moves when it grows */
+typedef struct reading
+{
+    char* block;
+    size_t size, cap;
+    entry_t* entries;
+    size_t n, ncap;
+} reading_t;
+
+/* Add a name being read */
+static int
+add_name (reading_t* r, const char* name, int type)
+{
+    size_t len = strlen (name);
+
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && !name[2])))
+        return 0;
+
+    if (r->size + len + 1 > r->cap)
+    {
+        size_t cap = r->cap ? r->cap * 2 : 4096;
+        char* b;
+        while (r->size + len + 1 > cap)
+            cap *= 2;
+        if (!(b = realloc (r->block, cap)))
+            return -1;
+        r->block = b;
+        r->cap   = cap;
+    }
+    if (r->n == r->ncap)
+    {
+        size_t cap = r->ncap ? r->ncap * 2 : 64;
+        entry_t* e = realloc (r->entries, cap * sizeof *e);
+        if (!e)
+            return -1;
+        r->entries = e;
+        r->ncap    = cap;
+    }
+
+    memcpy (r->block + r->size, name, len + 1);
+    r->entries[r->n].name = (const char*) (uintptr_t) r->size;
+    r->entries[r->n].len  = len;
+    r->entries[r->n].dir
+        = type == TYPE_DIR || type == TYPE_LINK || type == TYPE_UNKNOWN;
+    r->n++;
+    r->size += len + 1;
+    return 0;
+}
+
+#ifdef __linux__
+/* Record returned by getdents64 */
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* Read all names of a directory, by large batches */
+static int
+read_names (int fd, reading_t* r)
+{
+    static long buf[GLOB_BATCH / sizeof (long)];
+    long got;
+
+    while ((got = syscall (SYS_getdents64, fd, buf, sizeof buf)) > 0)
+        for (long pos = 0; pos < got;)
+        {
+            struct linux_dirent64* d = (void*) ((char*) buf + pos);
+            pos += d->d_reclen;
+            if (add_name (r, d->d_name, d->d_type) < 0)
+                return -1;
+        }
+    return got < 0 ? -1 : 0;
+}
+#else
+/* Read all names of a directory */
+static int
+read_names (int fd, reading_t* r)
+{
+    DIR* dir;
+    struct dirent* d;
+    int ret = 0;
+
+    if ((fd = dup (fd)) < 0 || !(dir = fdopendir (fd)))
+    {
+        if (fd >= 0)
+            close (fd);
+        return -1;
+    }
+    while (ret == 0 && (d = readdir (dir)))
+        ret = add_name (r, d->d_name, TYPE_UNKNOWN);
+    closedir (dir);
+    return ret;
+}
+#endif
+
+/* Listing of a directory, from the cache if still valid */
+static listing_t*
+get_listing (const char* dir)
+{
+    reading_t r = {0};
+    struct timespec now;
+    struct stat st;
+    listing_t* l;
+    int fd = open (*dir ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd < 0)
+        return NULL;
+    if (fstat (fd, &st) < 0)
+        goto err;
+
+    for (int i = 0; i < GLOB_CACHE; ++i)
+    {
+        l = &cache[i];
+        if (l->entries && l->dev == st.st_dev && l->ino == st.st_ino
+            && l->mtime.tv_sec == st.st_mtim.tv_sec
+            && l->mtime.tv_nsec == st.st_mtim.tv_nsec
+            && (l->line == line || !l->racy))
+        {
+            l->line = line;
+            close (fd);
+            return l;
+        }
+    }
+
+    clock_gettime (CLOCK_REALTIME, &now);
+    if (read_names (fd, &r) < 0)
+        goto err;
+    close (fd);
+
+    /* Now that the block does not move */
+    for (size_t i = 0; i < r.n; ++i)
+        r.entries[i].name = r.block + (uintptr_t) r.entries[i].name;
+    qsort (r.entries, r.n, sizeof *r.entries, compare_entries);
+
+    l          = &cache[cache_next];
+    cache_next = (cache_next + 1) % GLOB_CACHE;
+    free (l->entries);
+    free (l->block);
+
+    l->dev     = st.st_dev;
+    l->ino     = st.st_ino;
+    l->mtime   = st.st_mtim;
+    l->racy    = st.st_mtim.tv_sec >= now.tv_sec - 1;
+    l->line    = line;
+    l->entries = r.entries;
+    l->n       = r.n;
+    l->block   = r.block;
+
+    /* Never NULL for a valid listing, even empty */
+    if (!l->entries && !(l->entries = malloc (sizeof *l->entries)))
+        l->n = 0;
+    return l;
+
+err:
+    free (r.entries);
+    free (r.block);
+    close (fd);
+    return NULL;
+}
+
+/* Classify a segment */
+static void
+classify (segment_t* s, const char* pat)
+{
+    size_t len = strlen (pat);
+
+    s->pat    = pat;
+    s->lit    = NULL;
+    s->litlen = 0;
+
+    if (!strpbrk (pat, "*?[\\"))
+        s->kind = SEG_LITERAL;
+    else if (strcmp (pat, "*") == 0)
+        s->kind = SEG_ALL;
+    else if (pat[0] == '*' && !strpbrk (pat + 1, "*?[\\"))
+    {
+        s->kind   = SEG_SUFFIX;
+        s->lit    = pat + 1;
+        s->litlen = len - 1;
+    }
+    else if (pat[len - 1] == '*' && strcspn (pat, "*?[\\") == len - 1)
+    {
+        s->kind   = SEG_PREFIX;
+        s->lit    = pat;
+        s->litlen = len - 1;
+    }
+    else
+        s->kind = SEG_PATTERN;
+}
+
+/* Non zero if an entry matches a wildcard segment */
+static int
+match (const segment_t* s, const entry_t* e)
+{
+    /* Hidden files only for a pattern starting with '.' */
+    if (e->name[0] == '.' && s->pat[0] != '.')
+        return 0;
+
+    switch (s->kind)
+    {
+        case SEG_ALL:
+            return 1;
+        case SEG_SUFFIX:
+            return e->len >= s->litlen
+                   && memcmp (e->name + e->len - s->litlen, s->lit, s->litlen)
+                          == 0;
+        case SEG_PREFIX:
+            return strncmp (e->name, s->lit, s->litlen) == 0;
+        default:
+            return fnmatch (s->pat, e->name, FNM_PERIOD) == 0;
+    }
+}
+
+/* Add dir + name + an optional '/' to a list of paths */
+static int
+add_path (paths_t* p, const char* dir, const char* name, size_t len, int slash)
+{
+    size_t dlen = strlen (dir);
+    char* path;
+
+    if (p->n == p->cap)
+    {
+        size_t cap = p->cap ? p->cap * 2 : 64;
+        char** v   = realloc (p->v, cap * sizeof *v);
+        if (!v)
+            return -1;
+        p->v   = v;
+        p->cap = cap;
+    }
+    if (!(path = malloc (dlen + len + 2)))
+        return -1;
+
+    memcpy (path, dir, dlen);
+    memcpy (path + dlen, name, len);
+    if (slash)
+        path[dlen + len++] = '/';
+    path[dlen + len] = '\0';
+    p->v[p->n++]     = path;
+    return 0;
+}
+
+/* Free a list of paths */
+static void
+free_paths (paths_t* p)
+{
+    for (size_t i = 0; i < p->n; ++i)
+        free (p->v[i]);
+    free (p->v);
+    p->v   = NULL;
+    p->n   = 0;
+    p->cap = 0;
+}
+
+/* Paths of dir matching a segment */
+static int
+expand_segment (paths_t* next, const char* dir, const segment_t* s, int last)
+{
+    listing_t* l = get_listing (dir);
+    entry_t key;
+    entry_t* e;
+
+    if (!l)
+        return 0;
+
+    /* A literal segment is looked up, it must be a directory if not last */
+    if (s->kind == SEG_LITERAL)
+    {
+        key.name = s->pat;
+        e = bsearch (&key, l->entries, l->n, sizeof key, compare_entries);
+        if (e && (last || e->dir))
+            return add_path (next, dir, e->name, e->len, !last);
+        return 0;
+    }
+
+    for (e = l->entries; e < l->entries + l->n; ++e)
+        if ((last || e->dir) && match (s, e)
+            && add_path (next, dir, e->name, e->len, !last) < 0)
+            return -1;
+    return 0;
+}
+
+/* Paths matching a pattern, sorted and allocated in a, NULL if none */
+char**
+glob_expand (const char* pattern, Arena* a, size_t* n)
+{
+    paths_t cur = {0}, next = {0};
+    char* pat = strdup (pattern);
+    char** result = NULL;
+    char *seg, *slash, *prefix;
+    int dirs_only;
+    size_t len;
+
+    *n = 0;
+    if (!pat)
+        return NULL;
+
+    /* "*" + "/" keeps directories only */
+    len       = strlen (pat);
+    dirs_only = len > 1 && pat[len - 1] == '/';
+    while (len > 1 && pat[len - 1] == '/')
+        pat[--len] = '\0';
+
+    /* The prefix stops before the first segment with a wildcard */
+    seg = pat;
+    while ((slash = strchr (seg, '/'))
+           && strcspn (seg, "*?[\\") > (size_t) (slash - seg))
+        seg = slash + 1;
+
+    prefix = strndup (pat, seg - pat);
+    if (!prefix || add_path (&cur, prefix, "", 0, 0) < 0)
+        goto end;
+
+    /* Each remaining segment, empty ones of "a//b" are skipped */
+    while (seg && cur.n)
+    {
+        segment_t s;
+        int last;
+
+        if ((slash = strchr (seg, '/')))
+            *slash = '\0';
+        last = slash == NULL;
+
+        if (*seg)
+        {
+            classify (&s, seg);
+            for (size_t i = 0; i < cur.n; ++i)
+                if (expand_segment (&next, cur.v[i], &s, last && !dirs_only)
+                    < 0)
+                    goto end;
+            free_paths (&cur);
+            cur    = next;
+            next.v = NULL;
+            next.n = next.cap = 0;
+        }
+        seg = slash ? slash + 1 : NULL;
+    }
+
+    /* Candidates of "*" + "/" end with '/', check links and unknown types */
+    if (dirs_only)
+        for (size_t i = 0; i < cur.n;)
+        {
+            struct stat st;
+            if (stat (cur.v[i], &st) < 0 || !S_ISDIR (st.st_mode))
+            {
+                free (cur.v[i]);
+                cur.v[i] = cur.v[--cur.n];
+            }
+            else
+                ++i;
+        }
+
+    if (!cur.n)
+        goto end;
+
+    qsort (cur.v, cur.n, sizeof *cur.v, compare_paths);
+    result = arena_alloc (a, (cur.n + 1) * sizeof *result);
+    for (size_t i = 0; i < cur.n; ++i)
+        result[i] = arena_strndup (a, cur.v[i], strlen (cur.v[i]));
+    result[cur.n] = NULL;
+    *n            = cur.n;
+
+end:
+    free_paths (&cur);
+    free_paths (&next);
+    free (prefix);
+    free (pat);
+    return result;
+}
@@ -0,0 +1,16 @@
+#ifndef _GLOB_H
+#define _GLOB_H
+
+#include <stddef.h>
+
+#include "Arena.h"
+
+/* Pathname expansion of *, ? and [...] */
+/* Directory listings are cached, keyed by device, inode and mtime */
+
+/* Paths matching a pattern, sorted and allocated in a, NULL if none */
+extern char** glob_expand (const char* pattern, Arena* a, size_t* n);
+/* A new line starts, listings read before may be checked again */
+extern void glob_new_line (void);
+
+#endif
@@ -0,0 +1,510 @@
+/*
+    Command location table
+    ======================
+
+    Every lookup through execvp walks all $PATH directories and fails an
+    execve per miss. Here each command name is resolved once, its absolute
+    path is kept in an open addressing table and then executed directly.
+
+    The table is flushed by "hash -r" or as soon as $PATH changes.
+
+    Completion needs every name instead: each $PATH directory is listed
+    once and its executables kept sorted with its mtime, all of them are
+    merged in one sorted index searched by prefix. At each completion only
+    the directories are checked, one stat each, and only those modified are
+    listed and sorted again before the lists are merged again.
+*/
+
+#include "Hash.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Used when $PATH is not set, same as most libc */
+#define DEFAULT_PATH "/bin:/usr/bin"
+/* Initial number of slots, must be a power of two */
+#define HASH_MINSZ 64
+
+/* d_type of Linux, DT_* are not given by _XOPEN_SOURCE */
+#define TYPE_UNKNOWN 0
+#define TYPE_REG 8
+#define TYPE_LINK 10
+
+typedef struct hash_entry
+{
+    char* name;         /* Command name, NULL if free slot */
+    char* path;         /* Absolute path of the command */
+    unsigned long hits; /* Number of times it was used */
+} hash_entry_t;
+
+/* Open addressing table */
+static hash_entry_t* table = NULL;
+/* Number of slots in table */
+static size_t table_size = 0;
+/* Number of used slots in table */
+static size_t table_used = 0;
+/* Copy of $PATH used to fill the table */
+static char* table_path = NULL;
+
+/* A directory of $PATH, listed for completion */
+typedef struct path_dir
+{
+    char* dir;             /* Its path, "." for an empty entry */
+    struct timespec mtime; /* Its mtime when it was listed */
+    int listed;            /* 0 if it must be listed (again) */
+    char* names;           /* Its executables, each '\0' terminated */
+    size_t len;            /* Size of names */
+    size_t n;              /* Number of executables */
+    const char** sorted;   /* Its executables in order, in names */
+} path_dir_t;
+
+/* Directories of table_path, in order */
+static path_dir_t* dirs = NULL;
+static size_t dirs_n    = 0;
+/* Sorted names of every directory without duplicates, in their names */
+static const char** index_names = NULL;
+static size_t index_n           = 0;
+
+/* FNV-1a, good enough for command names */
+static uint32_t
+hash_str (const char* str)
+{
+    uint32_t h = 2166136261u;
+    while (*str)
+    {
+        h ^= (unsigned char) *str++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Get $PATH, or its default value */
+static const char*
+current_path (void)
+{
+    const char* path = getenv ("PATH");
+    return path ? path : DEFAULT_PATH;
+}
+
+/* Flush the table if $PATH is not the one used to fill it */
+static void
+check_path (void)
+{
+    const char* path = current_path ();
+
+    if (table_path && strcmp (table_path, path) == 0)
+        return;
+
+    hash_reset ();
+    table_path = strdup (path);
+}
+
+/* Find the slot of a name, either its own or the free one it should use */
+static hash_entry_t*
+find_slot (const char* name)
+{
+    size_t mask = table_size - 1;
+    size_t i    = hash_str (name) & mask;
+
+    while (table[i].name && strcmp (table[i].name, name) != 0)
+        i = (i + 1) & mask;
+
+    return &table[i];
+}
+
+/* Double the size of the table, keeps load factor under 1/2 */
+static int
+grow_table (void)
+{
+    hash_entry_t* old = table;
+    size_t old_size   = table_size;
+
+    table_size = old_size ? old_size * 2 : HASH_MINSZ;
+    if ((table = calloc (table_size, sizeof *table)) == NULL)
+    {
+        table      = old;
+        table_size = old_size;
+        return -1;
+    }
+
+    for (size_t i = 0; i < old_size; ++i)
+        if (old[i].name)
+            *find_slot (old[i].name) = old[i];
+
+    free (old);
+    return 0;
+}
+
+/* Search a command in $PATH, returns a malloc'd path */
+static char*
+search_path (const char* name)
+{
+    const char* dir = current_path ();
+    size_t namelen  = strlen (name);
+    struct stat st;
+
+    while (1)
+    {
+        const char* end = strchr (dir, ':');
+        size_t dirlen   = end ? (size_t) (end - dir) : strlen (dir);
+
+        /* Empty entry means current directory */
+        char* path = malloc (dirlen + namelen + 3);
+        if (path == NULL)
+            return NULL;
+
+        if (dirlen)
+            memcpy (path, dir, dirlen);
+        else
+            path[dirlen++] = '.';
+        path[dirlen] = '/';
+        memcpy (path + dirlen + 1, name, namelen + 1);
+
+        if (stat (path, &st) == 0 && S_ISREG (st.st_mode)
+            && access (path, X_OK) == 0)
+            return path;
+
+        free (path);
+
+        if (!end)
+            return NULL;
+        dir = end + 1;
+    }
+}
+
+/* Get or create the entry of a name */
+static hash_entry_t*
+hash_entry (const char* name)
+{
+    hash_entry_t* entry;
+    char* path;
+
+    /* Commands with a path are never searched */
+    if (strchr (name, '/'))
+        return NULL;
+
+    check_path ();
+
+    if (table_size && (entry = find_slot (name))->name)
+        return entry;
+
+    if ((path = search_path (name)) == NULL)
+        return NULL;
+
+    if ((table_used + 1) * 2 > table_size && grow_table () < 0)
+    {
+        free (path);
+        return NULL;
+    }
+
+    entry = find_slot (name);
+    if ((entry->name = strdup (name)) == NULL)
+    {
+        free (path);
+        return NULL;
+    }
+    entry->path = path;
+    entry->hits = 0;
+    ++table_used;
+
+    return entry;
+}
+
+/* Resolve a command name, counts a hit */
+const char*
+hash_lookup (const char* name)
+{
+    hash_entry_t* entry = hash_entry (name);
+    if (!entry)
+        return NULL;
+
+    ++entry->hits;
+    return entry->path;
+}
+
+/* Resolve a command name */
+int
+hash_add (const char* name)
+{
+    return hash_entry (name) ? 0 : -1;
+}
+
+/* Forget every listing */
+static void
+forget_dirs (void)
+{
+    for (size_t i = 0; i < dirs_n; ++i)
+    {
+        free (dirs[i].dir);
+        free (dirs[i].names);
+        free (dirs[i].sorted);
+    }
+    free (dirs);
+    free (index_names);
+    dirs        = NULL;
+    dirs_n      = 0;
+    index_names = NULL;
+    index_n     = 0;
+}
+
+/* Split table_path into its directories, none listed yet */
+static int
+split_path (void)
+{
+    const char* dir = table_path;
+
+    dirs_n = 1;
+    for (const char* c = dir; *c; ++c)
+        dirs_n += *c == ':';
+    if ((dirs = calloc (dirs_n, sizeof *dirs)) == NULL)
+    {
+        dirs_n = 0;
+        return -1;
+    }
+
+    for (size_t i = 0; i < dirs_n; ++i)
+    {
+        const char* end = strchr (dir, ':');
+        size_t len      = end ? (size_t) (end - dir) : strlen (dir);
+
+        /* Empty entry means current directory */
+        if ((dirs[i].dir = len ? strndup (dir, len) : strdup (".")) == NULL)
+        {
+            forget_dirs ();
+            return -1;
+        }
+        dir += len + 1;
+    }
+    return 0;
+}
+
+/* Order of names */
+static int
+compare_names (const void* a, const void* b)
+{
+    return strcmp (*(const char* const*) a, *(const char* const*) b);
+}
+
+/* Non zero if an entry of a directory may be executed, only stat'ed when
+ * readdir does not give its type; a link or a file is taken as is, the
+ * lookup checks it when it is run */
+static int
+is_command (DIR* dp, const struct dirent* ent)
+{
+    struct stat st;
+
+    if (ent->d_name[0] == '.')
+        return 0;
+#ifdef _DIRENT_HAVE_D_TYPE
+    if (ent->d_type != TYPE_UNKNOWN)
+        return ent->d_type == TYPE_REG || ent->d_type == TYPE_LINK;
+#endif
+    return fstatat (dirfd (dp), ent->d_name, &st, 0) == 0
+           && S_ISREG (st.st_mode) && (st.st_mode & 0111);
+}
+
+/* List the executables of a directory in order, an unreadable one has
+ * none */
+static void
+list_dir (path_dir_t* d)
+{
+    struct timespec now;
+    struct dirent* ent;
+    size_t cap = 0;
+    const char* name;
+    DIR* dp;
+
+    free (d->names);
+    free (d->sorted);
+    d->names  = NULL;
+    d->sorted = NULL;
+    d->len    = 0;
+    d->n      = 0;
+    d->listed = 1;
+
+    clock_gettime (CLOCK_REALTIME, &now);
+    if ((dp = opendir (d->dir)) == NULL)
+        return;
+
+    while ((ent = readdir (dp)))
+    {
+        size_t len = strlen (ent->d_name) + 1;
+
+        if (!is_command (dp, ent))
+            continue;
+
+        if (d->len + len > cap)
+        {
+            char* names;
+            cap = cap ? cap * 2 : 4096;
+            while (d->len + len > cap)
+                cap *= 2;
+            /* Incomplete, listed again next time */
+            if ((names = realloc (d->names, cap)) == NULL)
+            {
+                d->listed = 0;
+                break;
+            }
+            d->names = names;
+        }
+        memcpy (d->names + d->len, ent->d_name, len);
+        d->len += len;
+        ++d->n;
+    }
+    closedir (dp);
+
+    /* An entry added within a second would leave mtime unchanged */
+    if (d->mtime.tv_sec >= now.tv_sec - 1)
+        d->listed = 0;
+
+    /* Sorted once here, merged with the others each time one changes */
+    if ((d->sorted = malloc ((d->n ? d->n : 1) * sizeof *d->sorted)) == NULL)
+    {
+        d->n      = 0;
+        d->listed = 0;
+        return;
+    }
+    name = d->names;
+    for (size_t i = 0; i < d->n; ++i, name += strlen (name) + 1)
+        d->sorted[i] = name;
+    qsort (d->sorted, d->n, sizeof *d->sorted, compare_names);
+}
+
+/* Merge the sorted names of every directory in the index */
+static int
+build_index (void)
+{
+    size_t* next = calloc (dirs_n ? dirs_n : 1, sizeof *next);
+    size_t n     = 0;
+
+    for (size_t i = 0; i < dirs_n; ++i)
+        n += dirs[i].n;
+
+    free (index_names);
+    index_n = 0;
+    if ((index_names = malloc ((n ? n : 1) * sizeof *index_names)) == NULL
+        || !next)
+    {
+        free (next);
+        return -1;
+    }
+
+    /* The smallest head of the lists each time, $PATH is short; a name
+     * found in several directories is completed once */
+    for (;;)
+    {
+        const char* min = NULL;
+
+        for (size_t i = 0; i < dirs_n; ++i)
+            if (next[i] < dirs[i].n
+                && (!min || strcmp (dirs[i].sorted[next[i]], min) < 0))
+                min = dirs[i].sorted[next[i]];
+        if (!min)
+            break;
+
+        index_names[index_n++] = min;
+        for (size_t i = 0; i < dirs_n; ++i)
+            if (next[i] < dirs[i].n
+                && strcmp (dirs[i].sorted[next[i]], min) == 0)
+                ++next[i];
+    }
+
+    free (next);
+    return 0;
+}
+
+/* Commands of $PATH starting with prefix, sorted, NULL if none */
+const char* const*
+hash_complete (const char* prefix, size_t* n)
+{
+    size_t len  = strlen (prefix);
+    int changed = 0;
+    size_t lo   = 0;
+    size_t hi;
+    struct stat st;
+
+    *n = 0;
+    check_path ();
+    if (!dirs && split_path () < 0)
+        return NULL;
+
+    /* Only directories modified since they were listed */
+    for (size_t i = 0; i < dirs_n; ++i)
+    {
+        path_dir_t* d = &dirs[i];
+
+        if (stat (d->dir, &st) < 0)
+            st.st_mtim = (struct timespec){0, 0};
+        if (d->listed && st.st_mtim.tv_sec == d->mtime.tv_sec
+            && st.st_mtim.tv_nsec == d->mtime.tv_nsec)
+            continue;
+
+        d->mtime = st.st_mtim;
+        list_dir (d);
+        changed = 1;
+    }
+    if ((changed || !index_names) && build_index () < 0)
+        return NULL;
+
+    /* First name not before prefix */
+    hi = index_n;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp (index_names[mid], prefix) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    while (lo + *n < index_n
+           && strncmp (index_names[lo + *n], prefix, len) == 0)
+        ++*n;
+    return *n ? index_names + lo : NULL;
+}
+
+/* Forget everything */
+void
+hash_reset (void)
+{
+    forget_dirs ();
+    for (size_t i = 0; i < table_size; ++i)
+        if (table[i].name)
+        {
+            free (table[i].name);
+            free (table[i].path);
+        }
+
+    free (table);
+    free (table_path);
+    table      = NULL;
+    table_path = NULL;
+    table_size = 0;
+    table_used = 0;
+}
+
+/* Print the table */
+void
+hash_print (FILE* out)
+{
+    if (!table_used)
+    {
+        fprintf (out, "hash: hash table empty\n");
+        return;
+    }
+
+    fprintf (out, "hits\tcommand\tpath\n");
+    for (size_t i = 0; i < table_size; ++i)
+        if (table[i].name)
+            fprintf (out,
+                     "%4lu\t%s\t%s\n",
+                     table[i].hits,
+                     table[i].name,
+                     table[i].path);
+}
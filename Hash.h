@@ -0,0 +1,21 @@
+#ifndef _HASH_H
+#define _HASH_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* Command location table, remembers where each command was found in $PATH */
+
+/* Resolve a command name, NULL if not found or if the name contains a '/' */
+extern const char* hash_lookup (const char* name);
+/* Resolve a command name and remember it without counting a hit */
+extern int hash_add (const char* name);
+/* Forget every remembered location */
+extern void hash_reset (void);
+/* Commands of $PATH starting with prefix, sorted, NULL if none; valid until
+ * the next call */
+extern const char* const* hash_complete (const char* prefix, size_t* n);
+/* Print remembered locations and their hit counts */
+extern void hash_print (FILE* out);
+
+#endif
@@ -0,0 +1,260 @@
+/*
+    Persistent history
+    ==================
+
+    Entries are appended to $MINISHELL_HISTFILE (~/.minishell_history by
+    default) as soon as they are read, each by a single write on a file
+    opened with O_APPEND: concurrent shells interleave whole lines, and
+    nothing is rewritten on exit.
+
+    The file is mapped, not read. At startup only its end is looked at,
+    backwards, for the last entries given to readline, so starting does not
+    get slower as the file grows. The index of every entry is built the
+    first time "history" needs it, then only extended as the file grows.
+*/
+
+#include "History.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <readline/history.h>
+
+/* File in $HOME, unless given by HISTORY_ENV */
+#define HISTORY_FILE ".minishell_history"
+#define HISTORY_ENV "MINISHELL_HISTFILE"
+/* Number of entries given to readline, unless given by HISTORY_SIZE_ENV */
+#define HISTORY_LOAD 1000
+#define HISTORY_SIZE_ENV "MINISHELL_HISTSIZE"
+
+/* History file, -1 if not opened */
+static int hist_fd = -1;
+/* Mapping of the file */
+static const char* map = NULL;
+static size_t mapped   = 0;
+/* Offset of each entry, lazily built */
+static size_t* offsets = NULL;
+static size_t entries  = 0;
+static size_t capacity = 0;
+/* Bytes of the file indexed, up to the end of the last entry */
+static size_t indexed = 0;
+
+/* Open the history file, once */
+static int
+history_open (void)
+{
+    const char* path = getenv (HISTORY_ENV);
+    const char* home;
+    char* buf = NULL;
+
+    if (hist_fd >= 0)
+        return 0;
+
+    if (!path || !*path)
+    {
+        if (!(home = getenv ("HOME")) || !*home)
+            return -1;
+        if (!(buf = malloc (strlen (home) + sizeof HISTORY_FILE + 1)))
+            return -1;
+        strcpy (buf, home);
+        strcat (buf, "/" HISTORY_FILE);
+        path = buf;
+    }
+
+    hist_fd = open (path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    free (buf);
+    return hist_fd < 0 ? -1 : 0;
+}
+
+/* Map the whole file again if it grew, other shells append to it too */
+static int
+history_map (void)
+{
+    struct stat st;
+    void* m;
+
+    if (history_open () < 0 || fstat (hist_fd, &st) < 0)
+        return -1;
+    if ((size_t) st.st_size == mapped)
+        return 0;
+
+    if (map)
+        munmap ((void*) map, mapped);
+    map    = NULL;
+    mapped = 0;
+
+    /* Truncated by hand, start the index again */
+    if ((size_t) st.st_size < indexed)
+        entries = indexed = 0;
+
+    if (st.st_size == 0)
+        return 0;
+    if ((m = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, hist_fd, 0))
+        == MAP_FAILED)
+        return -1;
+
+    map    = m;
+    mapped = st.st_size;
+    return 0;
+}
+
+/* Open the history file and give its last entries to readline */
+int
+history_load (void)
+{
+    const char* size = getenv (HISTORY_SIZE_ENV);
+    long n           = size ? strtol (size, NULL, 10) : HISTORY_LOAD;
+    const char *p, *end;
+    char* line = NULL;
+    size_t cap = 0;
+
+    if (history_map () < 0)
+        return -1;
+    if (!mapped || n <= 0)
+        return 0;
+
+    /* A line still being written by another shell is not an entry */
+    end = map + mapped;
+    while (end > map && end[-1] != '\n')
+        --end;
+
+    /* Back over the last n entries only */
+    p = end;
+    for (long i = 0; i < n && p > map; ++i)
+        for (--p; p > map && p[-1] != '\n'; --p)
+            ;
+
+    /* Then forward, oldest first */
+    while (p < end)
+    {
+        const char* nl = memchr (p, '\n', end - p);
+        size_t len     = nl - p;
+
+        if (len && len + 1 > cap)
+        {
+            free (line);
+            if (!(line = malloc (cap = len + 1)))
+                return -1;
+        }
+        if (len)
+        {
+            memcpy (line, p, len);
+            line[len] = '\0';
+            add_history (line);
+        }
+        p = nl + 1;
+    }
+
+    free (line);
+    return 0;
+}
+
+/* Append an entry to the file, empty lines are not kept */
+void
+history_append (const char* line)
+{
+    struct iovec iov[2];
+
+    if (line[strspn (line, " \t")] == '\0' || history_open () < 0)
+        return;
+
+    /* One write, whole lines even with concurrent shells */
+    iov[0].iov_base = (void*) line;
+    iov[0].iov_len  = strlen (line);
+    iov[1].iov_base = "\n";
+    iov[1].iov_len  = 1;
+    writev (hist_fd, iov, 2);
+}
+
+/* Index entries appended since last time */
+static int
+history_index (void)
+{
+    const char *p, *end, *nl;
+
+    if (history_map () < 0)
+        return -1;
+
+    p   = map + indexed;
+    end = map + mapped;
+    while (p < end && (nl = memchr (p, '\n', end - p)))
+    {
+        if (entries == capacity)
+        {
+            size_t n  = capacity ? capacity * 2 : 1024;
+            size_t* o = realloc (offsets, n * sizeof *offsets);
+            if (!o)
+                return -1;
+            offsets  = o;
+            capacity = n;
+        }
+        offsets[entries++] = p - map;
+        p                  = nl + 1;
+    }
+    indexed = p - map;
+    return 0;
+}
+
+/* Length of an entry, without its '\n' */
+static inline size_t
+entry_length (size_t i)
+{
+    return (i + 1 < entries ? offsets[i + 1] : indexed) - offsets[i] - 1;
+}
+
+/* Non zero if an entry contains pattern */
+static int
+entry_matches (size_t i, const char* pattern, size_t plen)
+{
+    const char* s = map + offsets[i];
+    size_t len    = entry_length (i);
+    const char* end;
+
+    if (plen > len)
+        return 0;
+
+    /* First character, then the rest */
+    for (end = s + len - plen + 1;
+         (s = memchr (s, *pattern, end - s)) != NULL;
+         ++s)
+        if (memcmp (s, pattern, plen) == 0)
+            return 1;
+    return 0;
+}
+
+/* Print the last n entries (all if n <= 0) matching pattern (any if NULL),
+ * numbered from the first entry of the file */
+int
+history_print (FILE* out, long n, const char* pattern)
+{
+    size_t plen = pattern ? strlen (pattern) : 0;
+    size_t first, found, i;
+
+    if (history_index () < 0)
+        return -1;
+
+    /* Back from the newest, to the nth match */
+    first = 0;
+    if (n > 0)
+        for (i = entries, found = 0; i-- > 0;)
+            if ((!plen || entry_matches (i, pattern, plen))
+                && ++found == (size_t) n)
+            {
+                first = i;
+                break;
+            }
+
+    for (i = first; i < entries; ++i)
+        if (!plen || entry_matches (i, pattern, plen))
+            fprintf (out,
+                     "%5zu  %.*s\n",
+                     i + 1,
+                     (int) entry_length (i),
+                     map + offsets[i]);
+    return 0;
+}
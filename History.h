@@ -0,0 +1,18 @@
+#ifndef _HISTORY_H
+#define _HISTORY_H
+
+#include <stdio.h>
+
+/* Persistent history, an append-only file shared by every shell */
+/* One line per entry, each appended by a single write so that concurrent
+ * shells never mix their lines */
+
+/* Open the history file and give its last entries to readline */
+extern int history_load (void);
+/* Append an entry to the file, empty lines are not kept */
+extern void history_append (const char* line);
+/* Print the last n entries (all if n <= 0) matching pattern (any if NULL),
+ * numbered from the first entry of the file */
+extern int history_print (FILE* out, long n, const char* pattern);
+
+#endif
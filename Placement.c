@@ -0,0 +1,423 @@
+/*
+    Job placement
+    =============
+
+    "on cpus=0-7 nice=10 cmd" runs cmd pinned and reniced without the extra
+    exec of taskset or nice: the child applies the placement itself between
+    fork and exec. posix_spawn has no attribute for CPU affinity or cgroups,
+    so placed commands are always forked.
+
+    Keys are:
+        cpus=LIST       CPU affinity, as "0-3,8,10-11"
+        numa=NODE       memory bound to a node, CPUs restricted to its own
+        nice=N          nice value, absolute
+        sched=POLICY    other, batch, idle, fifo:PRIO or rr:PRIO
+        cgroup=PATH     cgroup v2 directory, relative to /sys/fs/cgroup
+
+    Everything but nice and sched is Linux only, elsewhere applying them
+    fails with ENOSYS.
+*/
+
+/* CPU sets and the non POSIX policies */
+#define _GNU_SOURCE
+
+#include "Placement.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+/* Root of cgroups v2 */
+#define CGROUP_ROOT "/sys/fs/cgroup"
+/* CPUs of a NUMA node */
+#define NUMA_CPULIST "/sys/devices/system/node/node%d/cpulist"
+/* Highest NUMA node */
+#define NUMA_MAX 1023
+/* Memory policy binding to the nodes given, from linux/mempolicy.h */
+#define MPOL_BIND 2
+
+/* Number of bits in a word of a CPU mask */
+#define WORD_BITS (8 * sizeof (unsigned long))
+
+/* Names of policies, fifo and rr take a priority */
+static const struct
+{
+    const char* name;
+    int policy;
+} policies[] = {{"other", SCHED_OTHER},
+#ifdef SCHED_BATCH
+                {"batch", SCHED_BATCH},
+#endif
+#ifdef SCHED_IDLE
+                {"idle", SCHED_IDLE},
+#endif
+                {"fifo", SCHED_FIFO},
+                {"rr", SCHED_RR},
+                {NULL, 0}};
+
+/* Parse a decimal number, -1 if invalid */
+static int
+parse_int (const char* s, const char** end, int* n)
+{
+    char* e;
+    long v;
+
+    errno = 0;
+    v     = strtol (s, &e, 10);
+    if (e == s || errno || v < INT_MIN || v > INT_MAX)
+        return -1;
+    *n = v;
+    if (end)
+        *end = e;
+    else if (*e)
+        return -1;
+    return 0;
+}
+
+/* Parse a CPU list as "0-3,8" into a mask */
+static int
+parse_cpus (const char* s, unsigned long* mask)
+{
+    int from, to;
+
+    memset (mask, 0, PLACE_NCPUS / 8);
+    do
+    {
+        if (parse_int (s, &s, &from) < 0)
+            return -1;
+        to = from;
+        if (*s == '-' && parse_int (s + 1, &s, &to) < 0)
+            return -1;
+        if (from < 0 || to < from || to >= PLACE_NCPUS)
+            return -1;
+        for (; from <= to; ++from)
+            mask[from / WORD_BITS] |= 1ul << (from % WORD_BITS);
+    } while (*s++ == ',');
+
+    /* Trailing '\n' of files in /sys */
+    return s[-1] == '\0' || s[-1] == '\n' ? 0 : -1;
+}
+
+/* Parse "key=value" into p, 1 if arg is not a placement, -1 if invalid */
+int
+placement_parse (placement_t* p, const char* arg)
+{
+    const char* value = strchr (arg, '=');
+    size_t len;
+
+    if (!value)
+        return 1;
+    len = value++ - arg;
+
+#define KEY(k) (len == sizeof k - 1 && strncmp (arg, k, len) == 0)
+    if (KEY ("cpus"))
+    {
+        if (parse_cpus (value, p->cpus) < 0)
+            return -1;
+        p->set |= PLACE_CPUS;
+    }
+    else if (KEY ("numa"))
+    {
+        if (parse_int (value, NULL, &p->numa) < 0 || p->numa < 0
+            || p->numa > NUMA_MAX)
+            return -1;
+        p->set |= PLACE_NUMA;
+    }
+    else if (KEY ("nice"))
+    {
+        if (parse_int (value, NULL, &p->nice) < 0)
+            return -1;
+        p->set |= PLACE_NICE;
+    }
+    else if (KEY ("sched"))
+    {
+        const char* prio = strchr (value, ':');
+        size_t n         = prio ? (size_t) (prio - value) : strlen (value);
+        int i;
+
+        for (i = 0; policies[i].name; ++i)
+            if (strlen (policies[i].name) == n
+                && strncmp (policies[i].name, value, n) == 0)
+                break;
+        if (!policies[i].name)
+            return -1;
+
+        /* Only real time policies have a priority */
+        p->policy   = policies[i].policy;
+        p->priority = 0;
+        if ((p->policy == SCHED_FIFO || p->policy == SCHED_RR)
+            != (prio != NULL))
+            return -1;
+        if (prio && parse_int (prio + 1, NULL, &p->priority) < 0)
+            return -1;
+        p->set |= PLACE_SCHED;
+    }
+    else if (KEY ("cgroup"))
+    {
+        if (!*value)
+            return -1;
+        p->cgroup = value;
+        p->set |= PLACE_CGROUP;
+    }
+    else
+        return 1;
+#undef KEY
+
+    return 0;
+}
+
+/* Everything given by from overrides what is in to */
+void
+placement_merge (placement_t* to, const placement_t* from)
+{
+    if (from->set & PLACE_CPUS)
+        memcpy (to->cpus, from->cpus, sizeof to->cpus);
+    if (from->set & PLACE_NUMA)
+        to->numa = from->numa;
+    if (from->set & PLACE_NICE)
+        to->nice = from->nice;
+    if (from->set & PLACE_SCHED)
+    {
+        to->policy   = from->policy;
+        to->priority = from->priority;
+    }
+    if (from->set & PLACE_CGROUP)
+        to->cgroup = from->cgroup;
+    to->set |= from->set;
+}
+
+#ifdef __linux__
+/* Move the calling process into a cgroup */
+static int
+join_cgroup (const char* cgroup)
+{
+    char path[PATH_MAX];
+    int fd, n;
+
+    n = snprintf (path,
+                  sizeof path,
+                  "%s%s%s/cgroup.procs",
+                  *cgroup == '/' ? "" : CGROUP_ROOT,
+                  *cgroup == '/' ? "" : "/",
+                  cgroup);
+    if (n < 0 || (size_t) n >= sizeof path)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    /* "0" is the writer itself */
+    if ((fd = open (path, O_WRONLY | O_CLOEXEC)) < 0)
+        return -1;
+    n = write (fd, "0\n", 2);
+    close (fd);
+    return n == 2 ? 0 : -1;
+}
+
+/* CPUs of a NUMA node */
+static int
+numa_cpus (int node, unsigned long* mask)
+{
+    char path[64];
+    char list[4096];
+    ssize_t n;
+    int fd;
+
+    snprintf (path, sizeof path, NUMA_CPULIST, node);
+    if ((fd = open (path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    n = read (fd, list, sizeof list - 1);
+    close (fd);
+    if (n <= 0)
+        return -1;
+    list[n] = '\0';
+
+    if (parse_cpus (list, mask) < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+/* Apply a placement to the calling process, errors are printed */
+int
+placement_apply (const placement_t* p)
+{
+    unsigned long cpus[PLACE_NCPUS / (8 * sizeof (unsigned long))];
+    int set = p->set & PLACE_CPUS;
+
+    memcpy (cpus, p->cpus, sizeof cpus);
+
+#ifdef __linux__
+    /* First, a cpuset of the cgroup restricts CPUs given after */
+    if ((p->set & PLACE_CGROUP) && join_cgroup (p->cgroup) < 0)
+    {
+        fprintf (stderr, "on: cgroup %s: %s\n", p->cgroup, strerror (errno));
+        return -1;
+    }
+
+    if (p->set & PLACE_NUMA)
+    {
+        unsigned long nodes[NUMA_MAX / WORD_BITS + 1] = {0};
+        unsigned long node[PLACE_NCPUS / (8 * sizeof (unsigned long))];
+
+        nodes[p->numa / WORD_BITS] |= 1ul << (p->numa % WORD_BITS);
+        if (numa_cpus (p->numa, node) < 0
+            || syscall (SYS_set_mempolicy, MPOL_BIND, nodes, NUMA_MAX + 2)
+                   < 0)
+        {
+            fprintf (stderr, "on: numa %d: %s\n", p->numa, strerror (errno));
+            return -1;
+        }
+
+        /* CPUs given are kept if they belong to the node */
+        for (size_t i = 0; i < sizeof cpus / sizeof *cpus; ++i)
+            cpus[i] = set ? cpus[i] & node[i] : node[i];
+        set = 1;
+    }
+
+    if (set)
+    {
+        cpu_set_t mask;
+
+        CPU_ZERO (&mask);
+        for (int cpu = 0; cpu < PLACE_NCPUS; ++cpu)
+            if (cpus[cpu / WORD_BITS] & (1ul << (cpu % WORD_BITS)))
+                CPU_SET (cpu, &mask);
+        if (sched_setaffinity (0, sizeof mask, &mask) < 0)
+        {
+            perror ("on: cpus");
+            return -1;
+        }
+    }
+#else
+    if (set || (p->set & (PLACE_NUMA | PLACE_CGROUP)))
+    {
+        fprintf (stderr, "on: %s\n", strerror (ENOSYS));
+        return -1;
+    }
+#endif
+
+    if (p->set & PLACE_SCHED)
+    {
+        struct sched_param param = {.sched_priority = p->priority};
+        if (sched_setscheduler (0, p->policy, &param) < 0)
+        {
+            perror ("on: sched");
+            return -1;
+        }
+    }
+
+    /* After the policy, which may reset it */
+    if ((p->set & PLACE_NICE) && setpriority (PRIO_PROCESS, 0, p->nice) < 0)
+    {
+        perror ("on: nice");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Append to a description, truncated */
+static void
+describe (char** buf, size_t* size, const char* fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (*size <= 1)
+        return;
+
+    va_start (ap, fmt);
+    n = vsnprintf (*buf, *size, fmt, ap);
+    va_end (ap);
+
+    if (n < 0)
+        return;
+    if ((size_t) n >= *size)
+        n = *size - 1;
+    *buf += n;
+    *size -= n;
+}
+
+/* Describe a placement as "key=value ...", truncated to size */
+void
+placement_describe (const placement_t* p, char* buf, size_t size)
+{
+    const char* sep = "";
+
+    if (size)
+        *buf = '\0';
+
+    if (p->set & PLACE_CPUS)
+    {
+        const char* comma = "";
+        int cpu           = 0;
+
+        describe (&buf, &size, "cpus=");
+        while (cpu < PLACE_NCPUS)
+        {
+            int from;
+
+            if (!(p->cpus[cpu / WORD_BITS] & (1ul << (cpu % WORD_BITS))))
+            {
+                ++cpu;
+                continue;
+            }
+
+            /* Ranges as given */
+            from = cpu;
+            while (cpu + 1 < PLACE_NCPUS
+                   && (p->cpus[(cpu + 1) / WORD_BITS]
+                       & (1ul << ((cpu + 1) % WORD_BITS))))
+                ++cpu;
+            if (from == cpu)
+                describe (&buf, &size, "%s%d", comma, from);
+            else
+                describe (&buf, &size, "%s%d-%d", comma, from, cpu);
+            comma = ",";
+            ++cpu;
+        }
+        sep = " ";
+    }
+
+    if (p->set & PLACE_NUMA)
+    {
+        describe (&buf, &size, "%snuma=%d", sep, p->numa);
+        sep = " ";
+    }
+    if (p->set & PLACE_NICE)
+    {
+        describe (&buf, &size, "%snice=%d", sep, p->nice);
+        sep = " ";
+    }
+    if (p->set & PLACE_SCHED)
+    {
+        int i;
+        for (i = 0; policies[i].name; ++i)
+            if (policies[i].policy == p->policy)
+                break;
+        describe (&buf,
+                  &size,
+                  p->priority ? "%ssched=%s:%d" : "%ssched=%s",
+                  sep,
+                  policies[i].name ? policies[i].name : "?",
+                  p->priority);
+        sep = " ";
+    }
+    if (p->set & PLACE_CGROUP)
+        describe (&buf, &size, "%scgroup=%s", sep, p->cgroup);
+}
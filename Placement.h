@@ -0,0 +1,39 @@
+#ifndef _PLACEMENT_H
+#define _PLACEMENT_H
+
+#include <stddef.h>
+
+/* Where a job runs: CPUs, NUMA node, scheduling and cgroup */
+/* Applied by the child between fork and exec, see "on" */
+
+/* Highest number of CPUs, same as glibc's CPU_SETSIZE */
+#define PLACE_NCPUS 1024
+
+/* What a placement sets */
+#define PLACE_CPUS 0x1
+#define PLACE_NUMA 0x2
+#define PLACE_NICE 0x4
+#define PLACE_SCHED 0x8
+#define PLACE_CGROUP 0x10
+
+typedef struct placement
+{
+    int set; /* PLACE_* flags */
+    unsigned long cpus[PLACE_NCPUS / (8 * sizeof (unsigned long))];
+    int numa;           /* NUMA node, its memory and CPUs */
+    int nice;           /* Nice value, absolute */
+    int policy;         /* Scheduling policy, SCHED_* */
+    int priority;       /* Priority of real time policies */
+    const char* cgroup; /* Cgroup directory, relative to /sys/fs/cgroup */
+} placement_t;
+
+/* Parse "key=value" into p, 1 if arg is not a placement, -1 if invalid */
+extern int placement_parse (placement_t* p, const char* arg);
+/* Everything given by from overrides what is in to */
+extern void placement_merge (placement_t* to, const placement_t* from);
+/* Apply a placement to the calling process, errors are printed */
+extern int placement_apply (const placement_t* p);
+/* Describe a placement as "key=value ...", truncated to size */
+extern void placement_describe (const placement_t* p, char* buf, size_t size);
+
+#endif
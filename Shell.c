@@ -3,17 +3,25 @@
 #include "Shell.h"
 
 #include "Affichage.h"
+#include "Cache.h"
 #include "Evaluation.h"
+#include "Hash.h"
+#include "History.h"
 
+#include <fcntl.h>
 #include <readline/history.h>
 #include <readline/readline.h>
 #include <stdbool.h>
 #include <stdio.h>
-
-extern int yyparse_string (char*);
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 Expression* ExpressionAnalysee;
 
+/* Mémoire de la ligne en cours : noeuds, listes d'arguments et chaînes */
+static Arena arena_ligne;
+Arena* ArenaCourante = &arena_ligne;
+
 bool interactive_mode = 1; // par d�faut on utilise readline
 int status            = 0; // valeur retourn�e par la derni�re commande
 
@@ -23,13 +31,7 @@ int status            = 0; // valeur retourn�e par la derni�re commande
 Expression*
 ConstruireNoeud (expr_t type, Expression* g, Expression* d, char** args)
 {
-    Expression* e;
-
-    if ((e = (Expression*) malloc (sizeof (Expression))) == NULL)
-    {
-        perror ("malloc");
-        exit (EXIT_FAILURE);
-    }
+    Expression* e = arena_alloc (ArenaCourante, sizeof (Expression));
 
     e->type      = type;
     e->gauche    = g;
@@ -38,47 +40,239 @@ ConstruireNoeud (expr_t type, Expression* g, Expression* d, char** args)
     return e;
 } /* ConstruireNoeud */
 
+/*
+ * Une liste d'arguments est précédée de sa longueur et de sa capacité
+ */
+typedef struct EnteteListe
+{
+    size_t longueur;       /* Nombre d'arguments, sans le NULL final */
+    size_t capacite;       /* Nombre d'arguments possibles, sans le NULL final */
+    unsigned char* marques; /* Marques de chaque argument, ou NULL */
+    int toutes;             /* Toutes les marques des arguments */
+} EnteteListe;
+
+#define ENTETE(l) ((EnteteListe*) (l) - 1)
+
+/*
+ * Alloue une liste vide pouvant contenir capacite arguments
+ */
+static char**
+AllouerListe (size_t capacite)
+{
+    EnteteListe* e = arena_alloc (
+        ArenaCourante, sizeof (EnteteListe) + (capacite + 1) * sizeof (char*));
+
+    e->longueur = 0;
+    e->capacite = capacite;
+    e->marques  = NULL;
+    e->toutes   = 0;
+    return (char**) (e + 1);
+}
+
 /*
  * Renvoie la longueur d'une liste d'arguments
  */
 int
 LongueurListe (char** l)
 {
-    char** p;
-    for (p = l; *p != NULL; p++)
-        ;
-    return p - l;
+    return ENTETE (l)->longueur;
 } /* LongueurListe */
 
 /*
  * Renvoie une liste d'arguments, la premi�re case �tant initialis�e � NULL, la
  * liste pouvant contenir NB_ARGS arguments (plus le pointeur NULL de fin de
- * liste)
+ * liste) avant d'être agrandie
  */
 char**
 InitialiserListeArguments (void)
 {
     char** l;
 
-    l  = (char**) (calloc (NB_ARGS + 1, sizeof (char*)));
+    l  = AllouerListe (NB_ARGS);
     *l = NULL;
     return l;
 } /* InitialiserListeArguments */
 
 /*
  * Ajoute en fin de liste le nouvel argument et renvoie la liste r�sultante
+ * Le mot est copié une seule fois, dans l'arène de la ligne
+ * Une liste pleine est recopiée dans une liste deux fois plus grande
  */
 char**
-AjouterArg (char** Liste, char* Arg)
+AjouterArg (char** Liste, const char* Arg, int Longueur)
 {
-    char** l;
+    return AjouterChaine (Liste, arena_strndup (ArenaCourante, Arg, Longueur));
+} /* AjouterArg */
 
-    l  = Liste + LongueurListe (Liste);
-    *l = (char*) (malloc (1 + strlen (Arg)));
-    strcpy (*l++, Arg);
-    *l = NULL;
+/*
+ * Ajoute en fin de liste une chaîne sans la copier, elle doit rester valide
+ * jusqu'à la fin de la ligne (dans l'arène ou dans l'arbre de la commande)
+ */
+char**
+AjouterChaine (char** Liste, char* Chaine)
+{
+    EnteteListe* e = ENTETE (Liste);
+
+    if (e->longueur == e->capacite)
+    {
+        char** l = AllouerListe (e->capacite * 2);
+        memcpy (l, Liste, e->longueur * sizeof (char*));
+        ENTETE (l)->longueur = e->longueur;
+        if (e->marques)
+        {
+            ENTETE (l)->marques
+                = arena_calloc (ArenaCourante, e->capacite * 2, 1);
+            memcpy (ENTETE (l)->marques, e->marques, e->capacite);
+            ENTETE (l)->toutes = e->toutes;
+        }
+        Liste = l;
+        e     = ENTETE (l);
+    }
+
+    Liste[e->longueur++] = Chaine;
+    Liste[e->longueur]   = NULL;
     return Liste;
-} /* AjouterArg */
+} /* AjouterChaine */
+
+/*
+ * Ajoute un mot de l'analyseur lexical, en retenant s'il est un motif à
+ * développer (*, ? ou [ hors guillemets) ou s'il contient des variables
+ */
+char**
+AjouterMot (char** Liste, Mot Mot)
+{
+    EnteteListe* e;
+    int marques = (Mot.motif ? MARQUE_MOTIF : 0)
+                  | (Mot.variable ? MARQUE_VARIABLE : 0);
+
+    Liste = AjouterArg (Liste, Mot.debut, Mot.longueur);
+    /* Hors guillemets, la sortie d'une commande est découpée en champs */
+    if (Mot.variable && !Mot.cite
+        && strstr (Liste[LongueurListe (Liste) - 1], "$("))
+        marques |= MARQUE_CHAMPS;
+    if (!marques)
+        return Liste;
+
+    e = ENTETE (Liste);
+    if (!e->marques)
+        e->marques = arena_calloc (ArenaCourante, e->capacite, 1);
+    e->marques[e->longueur - 1] = marques;
+    e->toutes |= marques;
+    return Liste;
+} /* AjouterMot */
+
+/*
+ * Renvoie les marques de tous les arguments de la liste
+ */
+int
+MarquesListe (char** l)
+{
+    return ENTETE (l)->toutes;
+} /* MarquesListe */
+
+/*
+ * Renvoie les marques de l'argument i de la liste
+ */
+int
+MarquesArg (char** l, int i)
+{
+    const EnteteListe* e = ENTETE (l);
+    return e->marques ? e->marques[i] : 0;
+} /* MarquesArg */
+
+/*
+ * Copie d'un arbre hors de l'arène, d'un seul bloc : noeuds, listes et
+ * chaînes sont posés les uns après les autres, alignés comme un pointeur
+ */
+#define ALIGNE(n) (((n) + sizeof (void*) - 1) & ~(sizeof (void*) - 1))
+
+static size_t
+TailleListe (char** l)
+{
+    size_t taille = ALIGNE (sizeof (EnteteListe)
+                            + (ENTETE (l)->longueur + 1) * sizeof (char*));
+    if (ENTETE (l)->marques)
+        taille += ALIGNE (ENTETE (l)->longueur);
+    for (; *l; ++l)
+        taille += ALIGNE (strlen (*l) + 1);
+    return taille;
+}
+
+/*
+ * Taille du bloc nécessaire à CopierExpression
+ */
+size_t
+TailleExpression (const Expression* e)
+{
+    size_t taille = 0;
+
+    /* Les séquences penchent à gauche : une boucle sur la gauche, la
+     * récursion à droite seulement, un long script ne vide pas la pile */
+    for (; e; e = e->gauche)
+        taille += ALIGNE (sizeof (Expression))
+                  + (e->arguments ? TailleListe (e->arguments) : 0)
+                  + TailleExpression (e->droite);
+    return taille;
+} /* TailleExpression */
+
+static char**
+CopierListe (char** l, char** bloc)
+{
+    EnteteListe* e = (EnteteListe*) *bloc;
+    char** copie   = (char**) (e + 1);
+    size_t i;
+
+    e->longueur = e->capacite = ENTETE (l)->longueur;
+    *bloc += ALIGNE (sizeof (EnteteListe) + (e->longueur + 1) * sizeof (char*));
+
+    e->marques = NULL;
+    e->toutes  = ENTETE (l)->toutes;
+    if (ENTETE (l)->marques)
+    {
+        e->marques = memcpy (*bloc, ENTETE (l)->marques, e->longueur);
+        *bloc += ALIGNE (e->longueur);
+    }
+
+    for (i = 0; i < e->longueur; ++i)
+    {
+        size_t n = strlen (l[i]) + 1;
+        copie[i] = memcpy (*bloc, l[i], n);
+        *bloc += ALIGNE (n);
+    }
+    copie[i] = NULL;
+    return copie;
+}
+
+static Expression*
+Copier (const Expression* e, char** bloc)
+{
+    Expression *racine = NULL, **lien = &racine;
+
+    /* Comme TailleExpression, une boucle sur la gauche */
+    for (; e; e = e->gauche)
+    {
+        Expression* c = (Expression*) *bloc;
+        *bloc += ALIGNE (sizeof (Expression));
+
+        c->type      = e->type;
+        c->arguments = e->arguments ? CopierListe (e->arguments, bloc) : NULL;
+        c->droite    = Copier (e->droite, bloc);
+        *lien        = c;
+        lien         = &c->gauche;
+    }
+    *lien = NULL;
+    return racine;
+}
+
+/*
+ * Copie une expression dans un bloc de TailleExpression (e) octets
+ */
+Expression*
+CopierExpression (const Expression* e, void* bloc)
+{
+    char* p = bloc;
+    return Copier (e, &p);
+} /* CopierExpression */
 
 /*
  * Fonction appel�e lorsque l'utilisateur tape "".
@@ -86,40 +280,393 @@ AjouterArg (char** Liste, char* Arg)
 void
 EndOfFile (void)
 {
-    exit (0);
+    exit (status);
 } /* EndOfFile */
 
 /*
- * Appel�e par yyparse() sur erreur syntaxique
+ * Lib�ration de la m�moire occup�e par une expression
+ * Tout est dans l'arène de la ligne, il suffit de la remettre à zéro, sa
+ * capacité est gardée pour la ligne suivante. L'arbre évalué vient du cache
+ * et n'est jamais libéré ici.
  */
 void
-yyerror (char* s)
+expression_free (Expression* e)
+{
+    (void) e;
+    arena_reset (ArenaCourante);
+}
+
+/* Script en cours : tampon entier (-c, fichier projeté) ou flux */
+static char* DebutScript = NULL;
+static char* Script      = NULL;
+static char* FinScript   = NULL;
+static FILE* FluxScript  = NULL;
+
+/* Document (<<) de la ligne en cours d'analyse, son texte suit la ligne */
+typedef struct Document
+{
+    Expression* noeud; // Redirection, arguments[0] est le délimiteur
+    bool developper;   // Délimiteur sans guillemets : variables développées
+} Document;
+
+static Document* Documents   = NULL;
+static int NbDocuments       = 0;
+static int CapaciteDocuments = 0;
+
+static void LireDocuments (bool lire);
+
+/* Nombre de lignes d'un script analysées d'avance */
+#define AVANCE 8
+
+/* Lignes du tampon du script déjà analysées, entre Script et Avance */
+static char* Avance        = NULL;
+static int NbAvance        = 0;
+static bool DocumentAvance = false; // La dernière attend son document
+/* Seul le shell lit le script, pas ses fils */
+static pid_t PidShell;
+
+/*
+ * Analyse en place une ligne terminée par '\n', suivie de deux octets
+ * modifiables : flex veut deux octets nuls après elle, ils sont remis ensuite.
+ * Une ligne du tampon du script est lue dans le seul tampon flex du script,
+ * sans rien poser après elle ; longueur devient alors ce que flex a lu, plus
+ * que la ligne si un texte entre guillemets continue sur les suivantes.
+ */
+static int
+AnalyserEnPlace (char* ligne, size_t* longueur, Analyse* analyse)
 {
-    fprintf (stderr, "%s\n", s);
+    char sauve[2];
+    char* fin;
+    int ret;
+
+    NbDocuments = 0;
+    if (DebutScript && ligne >= DebutScript && ligne < FinScript)
+    {
+        ret       = yyparse_script (ligne, analyse, &fin);
+        *longueur = fin - ligne;
+        return ret;
+    }
+
+    memcpy (sauve, ligne + *longueur, 2);
+    memset (ligne + *longueur, 0, 2);
+    ret = yyparse_buffer (ligne, *longueur + 2, analyse);
+    memcpy (ligne + *longueur, sauve, 2);
+    return ret;
 }
 
 /*
- * Lib�ration de la m�moire occup�e par une expression
+ * Analyse une ligne terminée par '\n', suivie de deux octets modifiables.
+ * Une ligne déjà vue reprend l'arbre du cache, sans passer par flex ni yacc.
+ */
+static int
+AnalyserLigne (char* ligne, size_t longueur)
+{
+    Analyse analyse = {NULL, false};
+    const Expression* e;
+    int ret;
+
+    if ((e = cache_lookup (ligne, longueur)))
+    {
+        ExpressionAnalysee = (Expression*) e;
+        return 0;
+    }
+
+    ret                = AnalyserEnPlace (ligne, &longueur, &analyse);
+    ExpressionAnalysee = analyse.resultat;
+
+    /* flex a pu lire au-delà de la ligne, la suite reprend après */
+    if (DebutScript && ligne >= DebutScript && ligne + longueur > Script)
+        Script = ligne + longueur;
+
+    /* Le texte des documents suit la ligne, qui ne va donc pas au cache */
+    if (NbDocuments)
+    {
+        LireDocuments (ret == 0);
+        return ret;
+    }
+
+    if (ret == 0 && (e = cache_insert (ligne, longueur, ExpressionAnalysee)))
+        ExpressionAnalysee = (Expression*) e;
+    return ret;
+}
+
+/*
+ * Analyse une commande pendant l'évaluation d'une autre (parallel)
+ * L'arbre reste dans l'arène de la ligne : l'ajouter au cache pourrait en
+ * chasser celui en cours d'évaluation. Renvoie NULL sur erreur syntaxique.
+ */
+Expression*
+AnalyserCommande (const char* commande)
+{
+    size_t longueur = strlen (commande);
+    char* ligne     = arena_alloc (ArenaCourante, longueur + 3);
+    Analyse analyse = {NULL, false};
+    const Expression* e;
+
+    memcpy (ligne, commande, longueur);
+    memcpy (ligne + longueur, "\n\0\0", 3);
+
+    if ((e = cache_lookup (ligne, ++longueur)))
+        return (Expression*) e;
+    if (AnalyserEnPlace (ligne, &longueur, &analyse) != 0)
+        return NULL;
+
+    /* Aucune ligne ne suit, les documents restent vides */
+    LireDocuments (false);
+    return analyse.resultat;
+}
+
+/*
+ * Ligne suivante d'un script, NULL à la fin
+ * Dans un tampon entier la ligne y reste, les deux octets suivants existent
+ * toujours : ceux de la ligne d'après, ou les deux nuls de la fin
+ */
+static char*
+LigneSuivante (size_t* longueur)
+{
+    static char* ligne     = NULL;
+    static size_t capacite = 0;
+    ssize_t lu;
+
+    if (Script)
+    {
+        char* debut = Script;
+        char* fin;
+
+        if (Script == FinScript)
+            return NULL;
+        fin       = memchr (Script, '\n', FinScript - Script);
+        Script    = fin + 1;
+        *longueur = Script - debut;
+        if (NbAvance)
+            --NbAvance;
+        return debut;
+    }
+
+    if ((lu = getline (&ligne, &capacite, FluxScript)) <= 0)
+        return NULL;
+
+    /* Place pour le '\n' final et les deux octets de flex */
+    if (capacite < (size_t) lu + 3
+        && (ligne = realloc (ligne, capacite = lu + 3)) == NULL)
+        return NULL;
+    if (ligne[lu - 1] != '\n')
+        ligne[lu++] = '\n';
+
+    *longueur = lu;
+    return ligne;
+}
+
+/*
+ * Analyse d'avance les lignes suivantes du script pendant qu'une commande
+ * tourne : leurs arbres vont au cache, où AnalyserLigne les retrouve. Seul
+ * un tampon entier est lu ainsi, la lecture d'un flux pourrait bloquer.
+ * Une erreur de syntaxe est tue, elle est signalée à son tour.
  */
 void
-expression_free (Expression* e)
+AnalyserAvance (void)
 {
-    if (e == NULL)
+    if (!Script || getpid () != PidShell)
         return;
 
-    expression_free (e->gauche);
-    expression_free (e->droite);
+    /* Tout a été exécuté, on repart de la ligne suivante */
+    if (!NbAvance)
+    {
+        Avance         = Script;
+        DocumentAvance = false;
+    }
+
+    /* Les lignes après un document sont son texte */
+    while (NbAvance < AVANCE && !DocumentAvance && Avance != FinScript)
+    {
+        Analyse analyse = {NULL, true};
+        char* ligne     = Avance;
+        size_t longueur;
+
+        Avance   = (char*) memchr (ligne, '\n', FinScript - ligne) + 1;
+        longueur = Avance - ligne;
+        ++NbAvance;
+
+        if (cache_lookup (ligne, longueur))
+            continue;
+        if (AnalyserEnPlace (ligne, &longueur, &analyse) == 0 && !NbDocuments)
+            cache_insert (ligne, longueur, analyse.resultat);
+        Avance = ligne + longueur;
+
+        /* Analysée de nouveau, puis son texte est lu */
+        DocumentAvance = NbDocuments;
+        NbDocuments    = 0;
+    }
+} /* AnalyserAvance */
+
+/*
+ * Vrai si la ligne en cours est la dernière d'un tampon entier (-c, fichier
+ * projeté) : il ne reste que des blancs, le shell se termine après elle
+ */
+bool
+DerniereLigne (void)
+{
+    char* c = Script;
+
+    if (!Script || getpid () != PidShell)
+        return false;
+    while (c != FinScript && (*c == ' ' || *c == '\t' || *c == '\n'))
+        ++c;
+    return c == FinScript;
+} /* DerniereLigne */
+
+/*
+ * Retient un document dont le texte est à lire après la ligne
+ */
+void
+AttendreDocument (Expression* noeud, Mot delimiteur)
+{
+    if (NbDocuments == CapaciteDocuments)
+    {
+        int capacite = CapaciteDocuments ? CapaciteDocuments * 2 : 4;
+        Document* d  = realloc (Documents, capacite * sizeof *d);
+
+        /* Le document reste vide */
+        if (!d)
+            return;
+        Documents         = d;
+        CapaciteDocuments = capacite;
+    }
+
+    Documents[NbDocuments].noeud      = noeud;
+    Documents[NbDocuments].developper = !delimiteur.cite;
+    ++NbDocuments;
+} /* AttendreDocument */
 
-    if (e->arguments != NULL)
+/*
+ * Ligne suivante d'un document, sans son '\n', NULL à la fin de l'entrée
+ */
+static char*
+LigneDocument (size_t* longueur)
+{
+    static char* ligne = NULL;
+    char* l;
+
+    if (!interactive_mode)
     {
-        for (int i = 0; e->arguments[i] != NULL; i++)
-            free (e->arguments[i]);
-        free (e->arguments);
+        if ((l = LigneSuivante (longueur)) && *longueur
+            && l[*longueur - 1] == '\n')
+            --*longueur;
+        return l;
     }
 
-    free (e);
+    free (ligne);
+    if ((ligne = readline ("> ")) != NULL)
+        *longueur = strlen (ligne);
+    return ligne;
 }
 
+/*
+ * Lit le texte des documents de la ligne, dans l'ordre, chacun jusqu'à son
+ * délimiteur seul sur une ligne. Il devient le second argument du noeud.
+ */
+static void
+LireDocuments (bool lire)
+{
+    char* texte     = NULL;
+    size_t capacite = 0;
+
+    for (int i = 0; i < NbDocuments; ++i)
+    {
+        Expression* noeud = Documents[i].noeud;
+        const char* fin   = noeud->arguments[0];
+        size_t lfin       = strlen (fin);
+        size_t taille     = 0;
+        char* ligne       = NULL;
+        size_t longueur;
+        Mot mot;
+
+        while (lire && (ligne = LigneDocument (&longueur)) != NULL
+               && !(longueur == lfin && memcmp (ligne, fin, lfin) == 0))
+        {
+            if (taille + longueur + 1 > capacite)
+            {
+                size_t c = capacite * 2 > taille + longueur + 1
+                               ? capacite * 2
+                               : taille + longueur + 1;
+                char* t  = realloc (texte, c);
+                if (!t)
+                    break;
+                texte    = t;
+                capacite = c;
+            }
+            memcpy (texte + taille, ligne, longueur);
+            taille += longueur;
+            texte[taille++] = '\n';
+        }
+
+        if (lire && !ligne)
+            fprintf (stderr, "Document terminé par la fin de l'entrée, "
+                             "%s attendu\n", fin);
+
+        mot.debut    = taille ? texte : "";
+        mot.longueur = taille;
+        mot.motif    = 0;
+        mot.variable = Documents[i].developper && taille
+                       && memchr (texte, '$', taille) != NULL;
+        mot.cite     = 0;
+        noeud->arguments = AjouterMot (noeud->arguments, mot);
+    }
+
+    free (texte);
+    NbDocuments = 0;
+} /* LireDocuments */
+
+/*
+ * Générateur de readline : les commandes internes commençant par le texte,
+ * puis celles de $PATH, tirées de l'index trié de Hash.c
+ */
+static char*
+GenererCommande (const char* texte, int etat)
+{
+    static const char* const* noms;
+    static size_t interne, suivant, n, longueur;
+    const char* nom;
+
+    if (!etat)
+    {
+        longueur = strlen (texte);
+        noms     = hash_complete (texte, &n);
+        interne  = 0;
+        suivant  = 0;
+    }
+
+    while ((nom = builtin_name (interne++)))
+        if (strncmp (nom, texte, longueur) == 0)
+            return strdup (nom);
+    if (suivant < n)
+        return strdup (noms[suivant++]);
+    return NULL;
+} /* GenererCommande */
+
+/*
+ * Complétion de readline : en position de commande (début de ligne ou après
+ * ;, |, & ou parenthèse), un nom de commande, sans lire aucun répertoire de
+ * $PATH qui n'a pas changé ; ailleurs, ou avec un '/', les noms de fichiers
+ */
+static char**
+CompleterCommande (const char* texte, int debut, int fin)
+{
+    (void) fin;
+
+    while (debut > 0
+           && (rl_line_buffer[debut - 1] == ' '
+               || rl_line_buffer[debut - 1] == '\t'))
+        --debut;
+    if ((debut > 0 && !strchr (";|&(", rl_line_buffer[debut - 1]))
+        || strchr (texte, '/'))
+        return NULL;
+
+    /* Pas de noms de fichiers si aucune commande ne correspond */
+    rl_attempted_completion_over = 1;
+    return rl_completion_matches (texte, GenererCommande);
+} /* CompleterCommande */
+
 /*
  * Lecture de la ligne de commande � l'aide de readline en mode interactif
  * M�morisation dans l'historique des commandes
@@ -140,14 +687,13 @@ my_yyparse (void)
             int ret;
             add_history (
                 line); // Enregistre la line non vide dans l'historique courant
+            history_append (line); // Et dans le fichier, tout de suite
 
-            int len       = strlen (line);
-            line          = realloc (line, len + 2);
-            line[len]     = '\n';
-            line[len + 1] = '\0';
+            int len   = strlen (line);
+            line      = realloc (line, len + 3);
+            line[len] = '\n';
 
-            ret = yyparse_string (
-                line); // Remplace l'entr�e standard de yyparse par s
+            ret = AnalyserLigne (line, len + 1);
 
             free (line);
             return ret;
@@ -159,7 +705,17 @@ my_yyparse (void)
         }
     }
     else
-        return yyparse ();
+    {
+        size_t longueur;
+        char* ligne = LigneSuivante (&longueur);
+
+        if (ligne == NULL)
+        {
+            EndOfFile ();
+            return -1;
+        }
+        return AnalyserLigne (ligne, longueur);
+    }
 }
 
 /*--------------------------------------------------------------------------------------.
@@ -199,23 +755,148 @@ my_yyparse (void)
    vers lequel on redirige.						      |
       `--------------------------------------------------------------------------------------*/
 
+/*
+ * Le script est tout entier dans tampon, "\n" et les deux octets nuls
+ * attendus par flex sont ajoutés après les taille premiers octets. flex le
+ * lit d'un seul tampon, chaque ligne reprend où la précédente s'est arrêtée.
+ */
+static int
+AnalyserTampon (char* tampon, size_t taille)
+{
+    tampon[taille]     = '\n';
+    tampon[taille + 1] = '\0';
+    tampon[taille + 2] = '\0';
+    if (yyscript_buffer (tampon, taille + 3) < 0)
+    {
+        perror ("yylex_init");
+        return -1;
+    }
+    DebutScript = Script = tampon;
+    FinScript            = tampon + taille + 1;
+    return 0;
+}
+
+/*
+ * Mode "-c" : la commande est analysée comme un script d'une ligne
+ */
+static int
+LireCommande (const char* commande)
+{
+    size_t taille = strlen (commande);
+    char* tampon  = malloc (taille + 3);
+
+    if (tampon == NULL)
+        return -1;
+    memcpy (tampon, commande, taille);
+    return AnalyserTampon (tampon, taille);
+}
+
+/*
+ * Mode script : un fichier ordinaire est projeté en mémoire, chaque ligne est
+ * analysée en place, sans copie. Les trois octets ajoutés tiennent dans la
+ * fin de la dernière page, remplie de zéros et privée.
+ * Sinon (tube, périphérique, page pleine), il est lu par gros blocs.
+ */
+static int
+LireScript (const char* chemin)
+{
+    struct stat st;
+    int fd = open (chemin, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0 || fstat (fd, &st) < 0)
+    {
+        perror (chemin);
+        if (fd >= 0)
+            close (fd);
+        return -1;
+    }
+
+    size_t taille = st.st_size;
+    size_t page   = sysconf (_SC_PAGESIZE);
+
+    if (S_ISREG (st.st_mode) && taille % page && page - taille % page >= 3)
+    {
+        char* tampon = mmap (
+            NULL, taille + 3, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close (fd);
+        if (tampon == MAP_FAILED)
+        {
+            perror (chemin);
+            return -1;
+        }
+        return AnalyserTampon (tampon, taille);
+    }
+
+    if ((FluxScript = fdopen (fd, "r")) == NULL)
+    {
+        perror (chemin);
+        close (fd);
+        return -1;
+    }
+    return 0;
+}
+
 int
 main (int argc, char** argv)
 {
-    using_history ();
+    const char* commande = NULL;
+    bool analyse_seule   = false;
+    int opt;
+
+    /* Les options s'arrêtent au nom du script */
+    while ((opt = getopt (argc, argv, "+c:n")) != -1)
+        switch (opt)
+        {
+            case 'c':
+                commande = optarg;
+                break;
+            case 'n':
+                /* Analyse sans exécuter, pour vérifier ou mesurer */
+                analyse_seule = true;
+                break;
+            default:
+                fprintf (
+                    stderr, "usage: %s [-n] [-c commande | script]\n", argv[0]);
+                return 2;
+        }
+
+    /* Sans terminal, ni readline ni contrôle des tâches */
+    if (commande || optind < argc)
+        interactive_mode = 0;
+    else
+        interactive_mode = isatty (STDIN_FILENO);
+
+    PidShell = getpid ();
+    if (commande && LireCommande (commande) < 0)
+        return 2;
+    if (!commande && optind < argc && LireScript (argv[optind]) < 0)
+        return 127;
+
+    if (interactive_mode)
+    {
+        using_history ();
+        rl_attempted_completion_function = CompleterCommande;
+        history_load ();
+    }
+    else if (!Script && !FluxScript)
+        FluxScript = stdin;
+
     while (1)
     {
         if (my_yyparse () == 0)
         { /* L'analyse a abouti */
 //            afficher_expr (ExpressionAnalysee);
 
-            status = evaluer_expr (ExpressionAnalysee);
+            if (!analyse_seule)
+                status = evaluer_expr (ExpressionAnalysee);
 
             expression_free (ExpressionAnalysee);
         }
         else
         {
             /* L'analyse de la ligne de commande a donn� une erreur */
+            if (analyse_seule)
+                status = 2;
         }
     }
     return 0;
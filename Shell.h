@@ -1,13 +1,21 @@
 #ifndef ANALYSE
 #define ANALYSE
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
 
-#define NB_ARGS 50
-#define TAILLE_ID 500
+#include "Arena.h"
+
+/* Capacité initiale d'une liste d'arguments, doublée quand elle est pleine */
+#define NB_ARGS 8
+
+/* Marques d'un argument, à développer avant de lancer la commande */
+#define MARQUE_MOTIF 1    // Motif de noms de fichiers
+#define MARQUE_VARIABLE 2 // Contient des variables
+#define MARQUE_CHAMPS 4   // Sortie de commandes hors guillemets, en champs
 
 typedef enum expr_t
 {
@@ -18,13 +26,26 @@ typedef enum expr_t
   SEQUENCE_OU,    // S�quence conditionnelle (||)
   BG,             // Tache en arriere plan
   PIPE,           // Pipe
+  CHRONO,         // Mesure du temps (time)
   REDIRECTION_I,  // Redirection entree
   REDIRECTION_O,  // Redirection sortie standard
   REDIRECTION_A,  // Redirection sortie standard, mode append
   REDIRECTION_E,  // Redirection sortie erreur
   REDIRECTION_EO, // Redirection sorties erreur et standard
+  REDIRECTION_HS, // Chaîne en entrée (<<<)
+  REDIRECTION_HD, // Document en entrée (<<), son texte suit le délimiteur
 } expr_t;
 
+/* Mot reconnu par l'analyseur lexical, pointe dans le tampon de flex */
+typedef struct Mot
+{
+  const char *debut;
+  int longueur;
+  bool motif;    // Contient *, ? ou [ hors guillemets
+  bool variable; // Contient $ hors apostrophes
+  bool cite;     // Entre guillemets ou apostrophes
+} Mot;
+
 typedef struct Expression
 {
   expr_t type;
@@ -33,15 +54,35 @@ typedef struct Expression
   char **arguments;
 } Expression;
 
-extern int yyparse(void);
+/* Une analyse de ligne, l'analyseur n'a pas d'autre état global */
+typedef struct Analyse
+{
+  Expression *resultat; // Arbre de la ligne
+  bool silencieux;      // Erreurs tues, pour une analyse d'avance
+} Analyse;
+
+int yyparse_buffer(char *, size_t, Analyse *);
+int yyscript_buffer(char *, size_t);
+int yyparse_script(char *, Analyse *, char **);
 Expression *ConstruireNoeud(expr_t, Expression *, Expression *, char **);
-char **AjouterArg(char **, char *);
+char **AjouterArg(char **, const char *, int);
+char **AjouterChaine(char **, char *);
+char **AjouterMot(char **, Mot);
+int MarquesListe(char **);
+int MarquesArg(char **, int);
 char **InitialiserListeArguments(void);
 int LongueurListe(char **);
+size_t TailleExpression(const Expression *);
+Expression *CopierExpression(const Expression *, void *);
 void EndOfFile(void);
+Expression *AnalyserCommande(const char *);
+void AttendreDocument(Expression *, Mot);
+void AnalyserAvance(void);
+bool DerniereLigne(void);
 
-void yyerror(char *s);
 extern Expression *ExpressionAnalysee;
+extern Arena *ArenaCourante;
 extern int status;
+extern bool interactive_mode;
 
 #endif /* ANALYSE */
@@ -0,0 +1,79 @@
+#!/bin/sh
+# Benchmarks of the mini shell, driven in batch mode
+# Usage: bench.sh [shell] > results.csv
+# Every line of the output is "benchmark,value,unit"
+
+SHELL_BIN=${1:-./Shell}
+# Number of commands of each run, override for faster or steadier runs
+N=${N:-2000}
+# Bytes pushed through each pipeline
+BYTES=${BYTES:-67108864}
+
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+
+# Current time in seconds
+now () {
+    date +%s.%N
+}
+
+# Print count / (end - start) scaled by a factor
+rate () {
+    awk -v n="$1" -v a="$2" -v b="$3" -v f="${4:-1}" \
+        'BEGIN { printf "%.1f", n / (b - a) / f }'
+}
+
+# run name count unit factor [shell options] script
+run () {
+    name=$1 count=$2 unit=$3 factor=$4
+    shift 4
+    start=$(now)
+    if ! "$SHELL_BIN" "$@" > /dev/null 2> "$TMP/err"; then
+        echo "$name: failed" >&2
+        cat "$TMP/err" >&2
+    fi
+    end=$(now)
+    echo "$name,$(rate "$count" "$start" "$end" "$factor"),$unit"
+}
+
+echo "benchmark,value,unit"
+
+# Trivial external commands, spawn and wait
+awk -v n="$N" 'BEGIN { for (i = 0; i < n; i++) print "true" }' > "$TMP/spawn"
+run spawn_true "$N" "cmd/s" 1 "$TMP/spawn"
+(MINISHELL_FORKSERVER=1; export MINISHELL_FORKSERVER
+    run spawn_true_forkserver "$N" "cmd/s" 1 "$TMP/spawn")
+
+# Internal commands, no process at all, many more to be measurable
+awk -v n="$((N * 50))" 'BEGIN { for (i = 0; i < n; i++) print "cd ." }' \
+    > "$TMP/builtin"
+run builtin_cd "$((N * 50))" "cmd/s" 1 "$TMP/builtin"
+
+# Parsing only, every line differs so none comes from the cache
+awk -v n="$N" 'BEGIN {
+    for (i = 0; i < n; i++) {
+        line = "cmd" i " -a arg" i
+        for (j = 0; j < 16; j++)
+            line = line " | f" j " x" i " > out" j " && g" j " \"quoted " i "\" 2> err ; h" j
+        print line
+    }
+}' > "$TMP/parse"
+run parse_lines "$N" "line/s" 1 -n "$TMP/parse"
+run parse_bytes "$(wc -c < "$TMP/parse")" "MB/s" 1048576 -n "$TMP/parse"
+
+# Throughput of pipelines from 2 to 16 stages
+for stages in 2 4 8 16; do
+    line="head -c $BYTES /dev/zero"
+    i=1
+    while [ "$i" -lt "$stages" ]; do
+        line="$line | cat"
+        i=$((i + 1))
+    done
+    echo "$line > /dev/null" > "$TMP/pipe"
+    run "pipeline_$stages" "$BYTES" "MB/s" 1048576 "$TMP/pipe"
+done
+
+# Job table churn, background jobs started and reaped
+awk -v n="$N" 'BEGIN { for (i = 0; i < n; i++) print "true &"; print "jobs" }' \
+    > "$TMP/jobs"
+run jobs_churn "$N" "job/s" 1 "$TMP/jobs"
@@ -0,0 +1,84 @@
+/*
+    Builtin table generator
+    =======================
+
+    Run at build time, writes on stdout a table indexed by
+    builtin_hash (name, BUILTINS_SEED) & (BUILTINS_SIZE - 1) where each
+    internal command of Builtins.def has its own slot. A lookup is then one
+    probe and one strcmp.
+*/
+
+#include "Builtins.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Seeds tried before the table is made bigger */
+#define MAX_SEEDS 100000
+
+static const char* names[] = {
+#define BUILTIN(name, handler, flags, help) #name,
+#include "Builtins.def"
+#undef BUILTIN
+};
+
+#define NB_BUILTINS (int) (sizeof names / sizeof *names)
+
+/* Try a seed, fills slots on success */
+static int
+try_seed (uint32_t seed, int size, int* slots)
+{
+    for (int i = 0; i < size; ++i)
+        slots[i] = -1;
+
+    for (int i = 0; i < NB_BUILTINS; ++i)
+    {
+        int slot = builtin_hash (names[i], seed) & (size - 1);
+        if (slots[slot] != -1)
+            return -1;
+        slots[slot] = i;
+    }
+
+    return 0;
+}
+
+int
+main (void)
+{
+    int size = 1;
+    int* slots;
+    uint32_t seed;
+
+    /* Start at a load factor under 1/2 */
+    while (size < 2 * NB_BUILTINS)
+        size *= 2;
+
+    for (;; size *= 2)
+    {
+        if ((slots = malloc (size * sizeof *slots)) == NULL)
+        {
+            perror ("mkbuiltins");
+            return EXIT_FAILURE;
+        }
+
+        for (seed = 0; seed < MAX_SEEDS; ++seed)
+            if (try_seed (seed, size, slots) == 0)
+                goto found;
+
+        free (slots);
+    }
+
+found:
+    printf ("/* Generated by mkbuiltins from Builtins.def, do not edit */\n\n");
+    printf ("#define BUILTINS_SEED %uu\n", seed);
+    printf ("#define BUILTINS_SIZE %d\n\n", size);
+    printf ("/* Index in builtins_list, -1 if free */\n");
+    printf ("static const signed char builtins_table[BUILTINS_SIZE] = {");
+    for (int i = 0; i < size; ++i)
+        printf ("%s%d", i ? ", " : "", slots[i]);
+    printf ("};\n");
+
+    free (slots);
+    return EXIT_SUCCESS;
+}